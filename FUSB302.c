@@ -13,20 +13,22 @@
 #include "tcpm_driver.h"
 #include "platform.h"
 
-#define PACKET_IS_GOOD_CRC(head) (PD_HEADER_TYPE(head) == PD_CTRL_GOOD_CRC && \
-				  PD_HEADER_CNT(head) == 0)
-
-static struct fusb302_chip_state {
-	int16_t cc_polarity;
-	int16_t vconn_enabled;
-	/* 1 = pulling up (DFP) 0 = pulling down (UFP) */
-	int16_t pulling_up;
-	int16_t rx_enable;
-	uint8_t control1;
-	uint8_t mdac_vnc;
-	uint8_t mdac_rd;
-	uint8_t msgid;
-} state[CONFIG_USB_PD_PORT_COUNT];
+static struct fusb302_chip_state state[CONFIG_USB_PD_PORT_COUNT];
+static uint16_t tx_header[CONFIG_USB_PD_PORT_COUNT];
+
+/*
+ * The chip keeps its configuration across a restart of the Pico, only
+ * our shadow of it needs carrying over.
+ */
+void fusb302_get_state(int16_t port, struct fusb302_chip_state *st)
+{
+	*st = state[port];
+}
+
+void fusb302_set_state(int16_t port, const struct fusb302_chip_state *st)
+{
+	state[port] = *st;
+}
 
 /*
  * Bring the FUSB302 out of reset after Hard Reset signaling. This will
@@ -658,77 +660,67 @@ int16_t fusb302_rx_fifo_is_empty(int16_t port)
 	return ret;
 }
 
-int16_t fusb302_tcpm_get_message(int16_t port, uint32_t * payload, int16_t *head,
-			     enum fusb302_rxfifo_tokens *sop)
+/* Straight from the RX FIFO into a descriptor, to be pd_msg_put() */
+struct pd_msg *fusb302_tcpm_get_message(int16_t port)
 {
-	/*
-	 * This is the buffer that will get the burst-read data
-	 * from the fusb302.
-	 *
-	 * It's re-used in a couple different spots, the worst of which
-	 * is the PD packet (not header) and CRC.
-	 * maximum size necessary = 28 + 4 = 32
-	 */
-	uint8_t buf[32];
+	/* Register address, then SOP token and header */
+	uint8_t buf[3];
+	struct pd_msg *m;
 	int16_t rv, len;
 
 	/* If our FIFO is empty then we have no packet */
 	if (fusb302_rx_fifo_is_empty(port))
-		return EC_ERROR_UNKNOWN;
-
-	/* Read until we have a non-GoodCRC packet or an empty FIFO */
-	do {
-		buf[0] = TCPC_REG_FIFOS;
-
-		/*
-		 * PART 1 OF BURST READ: Write in register address.
-		 * Issue a START, no STOP.
-		 */
-		rv = tcpc_xfer(port, buf, 1, 0, 0, I2C_XFER_START);
-
-		/*
-		 * PART 2 OF BURST READ: Read up to the header.
-		 * Issue a repeated START, no STOP.
-		 * only grab three bytes so we can get the header
-		 * and determine how many more bytes we need to read.
-		 * TODO: Check token to ensure valid packet.
-		 */
-		rv |= tcpc_xfer(port, 0, 0, buf, 3, I2C_XFER_START);
-
-		/* Grab the header */
-		*sop = buf[0] & fusb302_TKN_SOP_MASK;
-		*head = (buf[1] & 0xFF);
-		*head |= ((buf[2] << 8) & 0xFF00);
-
-		/* figure out packet length, subtract header bytes */
-		len = get_num_bytes(*head) - 2;
-
-		/*
-		 * PART 3 OF BURST READ: Read everything else.
-		 * No START, but do issue a STOP at the end.
-		 * add 4 to len to read CRC out
-		 */
-		rv |= tcpc_xfer(port, 0, 0, buf, len + 4, I2C_XFER_STOP);
-
-	} while (!rv && PACKET_IS_GOOD_CRC(*head) &&
-		 !fusb302_rx_fifo_is_empty(port));
-
-	if (!rv) {
-		/* Discard GoodCRC packets */
-		if (PACKET_IS_GOOD_CRC(*head))
-			rv = EC_ERROR_UNKNOWN;
-		else
-			memcpy(payload, buf, len);
+		return NULL;
+
+	/* Out of descriptors: lose what's there rather than spin on it */
+	m = pd_msg_get();
+	if (!m) {
+		fusb302_flush_rx_fifo(port);
+		return NULL;
 	}
 
 	/*
-	 * If our FIFO is non-empty then we may have a packet, we may get
-	 * fewer interrupts than packets due to interrupt latency.
+	 * One packet at a time, GoodCRCs included, so that they can be
+	 * traced. It is up to the caller to skip them.
 	 */
-	//if (!fusb302_rx_fifo_is_empty(port))
-	//  task_set_event(PD_PORT_TO_TASK_ID(port), PD_EVENT_RX, 0);
+	buf[0] = TCPC_REG_FIFOS;
 
-	return rv;
+	/*
+	 * PART 1 OF BURST READ: Write in register address.
+	 * Issue a START, no STOP.
+	 */
+	rv = tcpc_xfer(port, buf, 1, 0, 0, I2C_XFER_START);
+
+	/*
+	 * PART 2 OF BURST READ: Read up to the header.
+	 * Issue a repeated START, no STOP.
+	 * only grab three bytes so we can get the header
+	 * and determine how many more bytes we need to read.
+	 * TODO: Check token to ensure valid packet.
+	 */
+	rv |= tcpc_xfer(port, 0, 0, buf, 3, I2C_XFER_START);
+
+	/* Grab the header */
+	m->sop = buf[0] & fusb302_TKN_SOP_MASK;
+	m->header = buf[1] | (buf[2] << 8);
+
+	/* figure out packet length, subtract header bytes */
+	len = get_num_bytes(m->header) - 2;
+
+	/*
+	 * PART 3 OF BURST READ: Read everything else.
+	 * No START, but do issue a STOP at the end.
+	 * add 4 to len to read CRC out, past the data objects
+	 */
+	rv |= tcpc_xfer(port, 0, 0, (uint8_t *)m->data, len + 4,
+			I2C_XFER_STOP);
+
+	if (rv) {
+		pd_msg_put(m);
+		return NULL;
+	}
+
+	return m;
 }
 
 int16_t fusb302_tcpm_transmit(int16_t port, enum tcpm_transmit_type type,
@@ -747,8 +739,10 @@ int16_t fusb302_tcpm_transmit(int16_t port, enum tcpm_transmit_type type,
 	 * 1: "Star Transmission" Command
 	 * -
 	 * 40: 40 bytes worst-case
+	 *
+	 * Off the stack, messages only ever go out from the main loop.
 	 */
-	uint8_t buf[40];
+	static uint8_t buf[40];
 	int16_t buf_pos = 0;
 
 	int16_t reg;
@@ -758,6 +752,7 @@ int16_t fusb302_tcpm_transmit(int16_t port, enum tcpm_transmit_type type,
 
 	header |= state[port].msgid++ << 9;
 	state[port].msgid &= 0x7;
+	tx_header[port] = header;
 
 	switch (type) {
 	case TCPC_TX_SOP:
@@ -882,6 +877,13 @@ int16_t fusb302_tcpm_get_vbus_level(int16_t port)
 	return (reg & TCPC_REG_STATUS0_VBUSOK) ? 1 : 0;
 }
 
+/* The chip retries on its own and doesn't say how many times */
+void fusb302_get_tx_status(int16_t port, uint16_t *header, uint8_t *retries)
+{
+	*header = tx_header[port];
+	*retries = 0xff;
+}
+
 void fusb302_get_irq(int16_t port, int16_t *interrupt, int16_t *interrupta, int16_t *interruptb)
 {
 	/* reading interrupt registers clears them */
@@ -1003,3 +1005,21 @@ void tcpm_set_bist_test_data(int16_t port)
 	tcpc_write(port, TCPC_REG_CONTROL3, reg);
 }
 #endif
+
+const struct tcpm_drv fusb302_tcpm_drv = {
+	.init			= fusb302_tcpm_init,
+	.pd_reset		= fusb302_pd_reset,
+	.get_cc			= fusb302_tcpm_get_cc,
+	.get_vbus_level		= fusb302_tcpm_get_vbus_level,
+	.select_rp_value	= fusb302_tcpm_select_rp_value,
+	.set_cc			= fusb302_tcpm_set_cc,
+	.set_polarity		= fusb302_tcpm_set_polarity,
+	.set_vconn		= fusb302_tcpm_set_vconn,
+	.set_msg_header		= fusb302_tcpm_set_msg_header,
+	.set_rx_enable		= fusb302_tcpm_set_rx_enable,
+	.get_message		= fusb302_tcpm_get_message,
+	.transmit		= fusb302_tcpm_transmit,
+	.get_irq		= fusb302_get_irq,
+	.rx_fifo_is_empty	= fusb302_rx_fifo_is_empty,
+	.get_tx_status		= fusb302_get_tx_status,
+};
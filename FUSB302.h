@@ -14,6 +14,7 @@ extern "C" {
 
 #include <stdint.h>
 #include "usb_pd_tcpm.h"
+#include "pd_msg.h"
 
 /* Chip Device ID - 302A or 302B */
 #define fusb302_DEVID_302A 0x08
@@ -222,6 +223,22 @@ enum fusb302_rxfifo_tokens {
 
 extern const struct tcpm_drv fusb302_tcpm_drv;
 
+/* Shadow of the chip configuration */
+struct fusb302_chip_state {
+	int16_t cc_polarity;
+	int16_t vconn_enabled;
+	/* 1 = pulling up (DFP) 0 = pulling down (UFP) */
+	int16_t pulling_up;
+	int16_t rx_enable;
+	uint8_t control1;
+	uint8_t mdac_vnc;
+	uint8_t mdac_rd;
+	uint8_t msgid;
+};
+
+void fusb302_get_state(int16_t port, struct fusb302_chip_state *st);
+void fusb302_set_state(int16_t port, const struct fusb302_chip_state *st);
+
 // Common methods for TCPM implementations
 int16_t fusb302_tcpm_init(int16_t port);
 void fusb302_pd_reset(int16_t port);
@@ -234,12 +251,13 @@ int16_t fusb302_tcpm_set_polarity(int16_t port, int16_t polarity);
 int16_t fusb302_tcpm_set_vconn(int16_t port, int16_t enable);
 int16_t fusb302_tcpm_set_msg_header(int16_t port, int16_t power_role, int16_t data_role);
 int16_t fusb302_tcpm_set_rx_enable(int16_t port, int16_t enable);
-int16_t fusb302_tcpm_get_message(int16_t port, uint32_t *payload, int16_t *head, enum fusb302_rxfifo_tokens *sop);
+struct pd_msg *fusb302_tcpm_get_message(int16_t port);
 int16_t fusb302_tcpm_transmit(int16_t port, enum tcpm_transmit_type type, uint16_t header, const uint32_t *data);
 int16_t fusb302_tcpm_get_vbus_level(int16_t port);
 int16_t fusb302_tcpm_select_rp_value(int16_t port, int16_t rp);
 void fusb302_get_irq(int16_t port, int16_t *irq, int16_t *irqa, int16_t *irqb);
 int16_t fusb302_rx_fifo_is_empty(int16_t port);
+void fusb302_get_tx_status(int16_t port, uint16_t *header, uint8_t *retries);
 
 #ifdef __cplusplus
 }
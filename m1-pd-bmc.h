@@ -7,6 +7,7 @@
 
 #include "hardware/gpio.h"
 #include "hardware/i2c.h"
+#include "hardware/pio.h"
 #include "tusb.h"
 
 struct gpio_pin_config {
@@ -29,29 +30,81 @@ enum m1_pd_bmc_pins {
 	UART_RX,
 	SBU_SWAP,
 	SEL_USB,
+	UART_CTS,
+	UART_RTS,
 	LED_R_TX,
 	LED_R_RX,
-	M1_BMC_PIN_END = LED_R_RX,
+	PD_CC1_TX,		/* Only with the PIO PD PHY */
+	PD_CC1_RX,
+	PD_CC2_TX,
+	PD_CC2_RX,
+	M1_BMC_PIN_END = PD_CC2_RX,
 };
 
+struct tcpm_drv;
+
 struct hw_context {
 	const struct gpio_pin_config 	*pins;
-	uart_inst_t 			*const uart;
+	const struct tcpm_drv		*tcpm;
+	uart_inst_t 			*const uart;	/* NULL if on PIO */
+	PIO				pio;		/* TX on sm, RX on sm + 1 */
 	i2c_inst_t			*const i2c;
 	void				(*uart_handler)(void);
 	uint8_t		 		addr;
 	uint8_t				nr_pins;
 	uint8_t				uart_irq;
+	uint8_t				sm;
 };
 
 const struct hw_context *get_hw_from_port(int port);
+bool m1_pd_bmc_warm_early(unsigned int port, const struct hw_context *hw);
 void m1_pd_bmc_fusb_setup(unsigned int port,
 			  const struct hw_context *hw);
 void m1_pd_bmc_run(void);
 
+/* Per-port wake reasons for the main loop */
+#define EVT_PD_IRQ	(1U << 0)	/* FUSB302 INT asserted */
+#define EVT_UART_RX	(1U << 1)	/* DUT output waiting in the RX buffer */
+#define EVT_HOST_RX	(1U << 2)	/* Host input waiting upstream */
+#define EVT_TIMER	(1U << 3)	/* A timer expired */
+
+void m1_pd_bmc_wake(int port, uint32_t evt);
+
+bool uart_rx_drain(int32_t port, int budget);
+/* @us: when the line @buf starts in was received, 0 if unknown */
+void m1_pd_bmc_uart_rx(int32_t port, const char *buf, int len, uint64_t us);
+
+/* UART RX interrupt moderation policy */
+enum uart_rx_mod {
+	UART_RX_MOD_AUTO,
+	UART_RX_MOD_LOW,	/* Lowest latency */
+	UART_RX_MOD_HIGH,	/* Fewest interrupts */
+	UART_RX_MOD_NR,
+};
+
+void uart_set_rx_mod(int32_t port, enum uart_rx_mod mode);
+
+/* Per-line timestamps of the DUT output, optionally host-relative */
+void uart_set_timestamps(int32_t port, bool on);
+bool uart_get_timestamps(int32_t port);
+void uart_rx_record(int32_t port, bool on);
+void uart_rx_stats(int32_t port, uint32_t *good, uint32_t *errors,
+		  uint32_t *lost);
+void uart_set_timebase(uint64_t us);
+uint64_t host_time_us(void);
+
+/* Target-bound side of the UART, whether it is a PL011 or on PIO */
+bool uart_tx_ready(int32_t port);
+void uart_tx_bytes(int32_t port, const char *ptr, int len);
+void uart_tx_break(int32_t port, bool on);
+
+/* Returns the rate actually set, 0 if out of reach */
+uint32_t uart_set_baud(int32_t port, uint32_t baud);
+uint32_t uart_get_baud(int32_t port);
+
 struct upstream_ops {
 	void	(*tx_bytes)(int32_t port, const char *ptr, int len);
-	int32_t	(*rx_byte)(int32_t port);
+	int	(*rx_bytes)(int32_t port, char *buf, int len);
 	void	(*flush)(void);
 };
 
@@ -61,6 +114,67 @@ bool upstream_is_serial(void);
 
 void upstream_tx_str(int32_t port, const char *ptr);
 
+/* Boot milestones, recorded the first time they happen on each port */
+enum boot_event {
+	BOOT_USB_MOUNT,		/* Enumerated by the host */
+	BOOT_PD_READY,		/* FUSB302 up and running */
+	BOOT_SERIAL,		/* Serial claim ACKed by the Mac */
+	BOOT_HOST_OPEN,		/* Port opened by the host */
+	BOOT_NR_EVENTS,
+};
+
+void boot_mark(enum boot_event ev, int32_t port);
+int boot_format(int32_t port, char *buf, int size);
+
+/* PD link health, per port, in CS_REQ_PD_STATS order */
+enum pd_stat {
+	PD_STAT_TX,		/* Messages handed to the PHY */
+	PD_STAT_TX_OK,		/* GoodCRC received */
+	PD_STAT_TX_FAIL,	/* Out of retries */
+	PD_STAT_COLLISION,	/* CC busy when trying to send */
+	PD_STAT_HARD_RESET_TX,
+	PD_STAT_HARD_RESET_RX,
+	PD_STAT_RX_SOP,		/* Received, GoodCRCs included */
+	PD_STAT_RX_SOP1,
+	PD_STAT_RX_SOP2,
+	PD_STAT_RX_SOP1_DEBUG,
+	PD_STAT_RX_SOP2_DEBUG,
+	PD_STAT_GOODCRC,	/* Received and dropped */
+	PD_STAT_NR,
+};
+
+struct pd_counter {
+	uint32_t	count;
+	uint64_t	last_us;	/* Host time if the timebase was set */
+} __attribute__((packed));
+
+/* Fills @buf with as many counters as fit, returns the length */
+int pd_stats_read(int32_t port, uint8_t *buf, int size, bool clear);
+
+/*
+ * Raw mode: no escape processing, no translation and no messages on
+ * the port, until one of the exit conditions is seen.
+ */
+#define RAW_EXIT_BREAK	(1U << 0)	/* Break from the host */
+#define RAW_EXIT_DTR	(1U << 1)	/* DTR toggled by the host */
+
+void upstream_set_raw(int32_t port, uint8_t exit_on);
+void upstream_apply_raw(int32_t port);	/* Main loop only */
+uint8_t upstream_get_raw(int32_t port);
+
+/*
+ * Vendor control requests, addressed to the device, with wIndex
+ * holding the port number.
+ */
+enum cs_vendor_request {
+	CS_REQ_RAW		= 1,	/* wValue: RAW_EXIT_*, 0 to leave */
+	CS_REQ_TIMESTAMPS	= 2,	/* wValue: 1 for on, 0 for off */
+	CS_REQ_TIMEBASE		= 3,	/* OUT: u64 LE, current time in us */
+	CS_REQ_TRACE		= 4,	/* wValue: 1 to trace PD, 0 to stop */
+	CS_REQ_TRACE_READ	= 5,	/* IN: struct pdtrace_rec, any port */
+	CS_REQ_PD_STATS		= 6,	/* IN: struct pd_counter[], wValue 1 clears */
+};
+
 #define PRINTF_SIZE	512
 
 #define __printf(__p, __f, ...)	do {					\
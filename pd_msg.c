@@ -0,0 +1,36 @@
+// Fixed pool of PD message descriptors, filled in place by the PHYs
+
+#include <stddef.h>
+
+#include "pico.h"
+#include "hardware/sync.h"
+#include "pd_msg.h"
+
+static struct pd_msg pd_msg_pool[PD_MSG_POOL];
+static uint32_t pd_msg_free = (1U << PD_MSG_POOL) - 1;
+
+struct pd_msg *__not_in_flash_func(pd_msg_get)(void)
+{
+	struct pd_msg *m = NULL;
+	uint32_t flags;
+
+	flags = save_and_disable_interrupts();
+	if (pd_msg_free) {
+		int i = __builtin_ctz(pd_msg_free);
+
+		pd_msg_free &= ~(1U << i);
+		m = &pd_msg_pool[i];
+	}
+	restore_interrupts(flags);
+
+	return m;
+}
+
+void pd_msg_put(struct pd_msg *m)
+{
+	uint32_t flags;
+
+	flags = save_and_disable_interrupts();
+	pd_msg_free |= 1U << (m - pd_msg_pool);
+	restore_interrupts(flags);
+}
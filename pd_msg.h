@@ -0,0 +1,22 @@
+// Fixed pool of PD message descriptors, filled in place by the PHYs
+
+#ifndef PD_MSG_H
+#define PD_MSG_H
+
+#include <stdint.h>
+
+/* Enough for a full PIO RX queue and the one being handled */
+#define PD_MSG_POOL	8
+
+struct pd_msg {
+	uint16_t	header;
+	uint8_t		sop;		/* enum fusb302_rxfifo_tokens */
+	/* Up to 7 data objects, the CRC lands right after the last one */
+	uint32_t	data[8];
+};
+
+/* Both are safe from interrupt context, get returns NULL when empty */
+struct pd_msg *pd_msg_get(void);
+void pd_msg_put(struct pd_msg *m);
+
+#endif
@@ -0,0 +1,259 @@
+// USB-PD physical layer coding: 4b5b, CRC32, ordered sets and BMC
+
+#include <string.h>
+
+#include "pd_phy.h"
+
+/*
+ * The PIO PHY decodes and answers from its interrupt, where waiting on
+ * a flash cache miss costs more than a bit time. Nothing special on
+ * the host.
+ */
+#ifdef PD_PHY_PIO
+#include "pico.h"
+#define PD_PHY_RAM_FUNC(f)	__not_in_flash_func(f)
+#define PD_PHY_RAM_DATA		__not_in_flash("pd_phy")
+#else
+#define PD_PHY_RAM_FUNC(f)	f
+#define PD_PHY_RAM_DATA
+#endif
+
+static const uint8_t enc4b5b[16] PD_PHY_RAM_DATA = {
+	0x1e, 0x09, 0x14, 0x15, 0x0a, 0x0b, 0x0e, 0x0f,
+	0x12, 0x13, 0x16, 0x17, 0x1a, 0x1b, 0x1c, 0x1d,
+};
+
+/* 0xff for the K-codes and the invalid symbols */
+static const uint8_t dec4b5b[32] PD_PHY_RAM_DATA = {
+	[0 ... 31] = 0xff,
+	[0x1e] = 0x0, [0x09] = 0x1, [0x14] = 0x2, [0x15] = 0x3,
+	[0x0a] = 0x4, [0x0b] = 0x5, [0x0e] = 0x6, [0x0f] = 0x7,
+	[0x12] = 0x8, [0x13] = 0x9, [0x16] = 0xa, [0x17] = 0xb,
+	[0x1a] = 0xc, [0x1b] = 0xd, [0x1c] = 0xe, [0x1d] = 0xf,
+};
+
+/* First K-code on the wire first */
+static const struct {
+	enum pd_phy_sop	sop;
+	uint8_t		k[4];
+} ordered_sets[] PD_PHY_RAM_DATA = {
+	{ PD_PHY_SOP,		{ PD_K_SYNC1, PD_K_SYNC1, PD_K_SYNC1, PD_K_SYNC2 } },
+	{ PD_PHY_SOP1,		{ PD_K_SYNC1, PD_K_SYNC1, PD_K_SYNC3, PD_K_SYNC3 } },
+	{ PD_PHY_SOP2,		{ PD_K_SYNC1, PD_K_SYNC3, PD_K_SYNC1, PD_K_SYNC3 } },
+	{ PD_PHY_SOP1_DEBUG,	{ PD_K_SYNC1, PD_K_RST2,  PD_K_RST2,  PD_K_SYNC3 } },
+	{ PD_PHY_SOP2_DEBUG,	{ PD_K_SYNC1, PD_K_RST2,  PD_K_SYNC3, PD_K_SYNC2 } },
+	{ PD_PHY_HARD_RESET,	{ PD_K_RST1,  PD_K_RST1,  PD_K_RST1,  PD_K_RST2 } },
+	{ PD_PHY_CABLE_RESET,	{ PD_K_RST1,  PD_K_SYNC1, PD_K_RST1,  PD_K_SYNC3 } },
+};
+
+static bool PD_PHY_RAM_FUNC(pd_phy_is_reset)(enum pd_phy_sop sop)
+{
+	return sop == PD_PHY_HARD_RESET || sop == PD_PHY_CABLE_RESET;
+}
+
+uint32_t PD_PHY_RAM_FUNC(pd_crc32)(const uint8_t *buf, int len)
+{
+	uint32_t crc = ~0U;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (int i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+static void PD_PHY_RAM_FUNC(tx_half)(struct pd_phy_tx *tx, bool level)
+{
+	if (level)
+		tx->buf[tx->halfbits / 32] |= 1U << (tx->halfbits % 32);
+	tx->halfbits++;
+}
+
+/* Every bit starts with an edge, and a one has another one mid-way */
+static void PD_PHY_RAM_FUNC(tx_bits)(struct pd_phy_tx *tx, uint32_t val, int nr)
+{
+	while (nr--) {
+		tx->level = !tx->level;
+		tx_half(tx, tx->level);
+		if (val & 1)
+			tx->level = !tx->level;
+		tx_half(tx, tx->level);
+		val >>= 1;
+	}
+}
+
+static void PD_PHY_RAM_FUNC(tx_byte)(struct pd_phy_tx *tx, uint8_t byte)
+{
+	tx_bits(tx, enc4b5b[byte & 0xf], 5);
+	tx_bits(tx, enc4b5b[byte >> 4], 5);
+}
+
+bool PD_PHY_RAM_FUNC(pd_phy_encode)(struct pd_phy_tx *tx, enum pd_phy_sop sop,
+				    uint16_t header, const uint32_t *data)
+{
+	int i, cnt = (header >> 12) & 7;
+	uint8_t buf[PD_PHY_MAX_BYTES];
+	int len = 0;
+	uint32_t crc;
+
+	for (i = 0; i < sizeof(ordered_sets) / sizeof(ordered_sets[0]); i++) {
+		if (ordered_sets[i].sop == sop)
+			break;
+	}
+	if (i == sizeof(ordered_sets) / sizeof(ordered_sets[0]))
+		return false;
+
+	memset(tx->buf, 0, sizeof(tx->buf));
+	tx->halfbits = 0;
+	tx->level = false;
+
+	/* 0101..., starting from a low line */
+	for (int j = 0; j < PD_PHY_PREAMBLE_BITS; j++)
+		tx_bits(tx, j & 1, 1);
+
+	for (int j = 0; j < 4; j++)
+		tx_bits(tx, ordered_sets[i].k[j], 5);
+
+	if (!pd_phy_is_reset(sop)) {
+		buf[len++] = header;
+		buf[len++] = header >> 8;
+		if (cnt)
+			memcpy(&buf[len], data, cnt * 4);
+		len += cnt * 4;
+
+		crc = pd_crc32(buf, len);
+		for (int j = 0; j < 4; j++)
+			buf[len++] = crc >> (8 * j);
+
+		for (int j = 0; j < len; j++)
+			tx_byte(tx, buf[j]);
+
+		tx_bits(tx, PD_K_EOP, 5);
+	}
+
+	/* Finish on an edge, and leave the line low */
+	tx_half(tx, !tx->level);
+	tx_half(tx, false);
+	tx->level = false;
+
+	return true;
+}
+
+enum {
+	RX_HUNT,
+	RX_DATA,
+};
+
+void PD_PHY_RAM_FUNC(pd_phy_rx_reset)(struct pd_phy_rx *rx)
+{
+	rx->shift = 0;
+	rx->state = RX_HUNT;
+	rx->nbits = 0;
+	rx->len = 0;
+	rx->high = false;
+}
+
+/* The spec lets one K-code out of four be corrupted */
+static bool PD_PHY_RAM_FUNC(rx_match_sop)(struct pd_phy_rx *rx)
+{
+	for (int i = 0; i < sizeof(ordered_sets) / sizeof(ordered_sets[0]); i++) {
+		int match = 0;
+
+		for (int j = 0; j < 4; j++)
+			match += ((rx->shift >> (5 * j)) & 0x1f) == ordered_sets[i].k[j];
+
+		if (match >= 3) {
+			rx->sop = ordered_sets[i].sop;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static enum pd_phy_rx_status PD_PHY_RAM_FUNC(rx_check)(struct pd_phy_rx *rx)
+{
+	uint16_t header;
+	uint32_t crc;
+
+	if (rx->high || rx->len < 6)
+		return PD_PHY_RX_ERROR;
+
+	header = rx->buf[0] | (rx->buf[1] << 8);
+	if (rx->len != 2 + 4 * ((header >> 12) & 7) + 4)
+		return PD_PHY_RX_ERROR;
+
+	crc = (rx->buf[rx->len - 4] | (rx->buf[rx->len - 3] << 8) |
+	       (rx->buf[rx->len - 2] << 16) | ((uint32_t)rx->buf[rx->len - 1] << 24));
+	if (crc != pd_crc32(rx->buf, rx->len - 4))
+		return PD_PHY_RX_ERROR;
+
+	return PD_PHY_RX_DONE;
+}
+
+enum pd_phy_rx_status PD_PHY_RAM_FUNC(pd_phy_rx_bit)(struct pd_phy_rx *rx, int bit)
+{
+	uint8_t sym, nibble;
+
+	if (rx->state == RX_HUNT) {
+		/* Last 20 bits, oldest in the LSBs */
+		rx->shift = (rx->shift >> 1) | ((uint32_t)!!bit << 19);
+		if (rx->nbits < 20) {
+			rx->nbits++;
+			return PD_PHY_RX_MORE;
+		}
+
+		if (!rx_match_sop(rx))
+			return PD_PHY_RX_MORE;
+
+		if (pd_phy_is_reset(rx->sop))
+			return PD_PHY_RX_DONE;
+
+		rx->state = RX_DATA;
+		rx->shift = 0;
+		rx->nbits = 0;
+		return PD_PHY_RX_MORE;
+	}
+
+	rx->shift |= !!bit << rx->nbits;
+	if (++rx->nbits < 5)
+		return PD_PHY_RX_MORE;
+
+	sym = rx->shift;
+	rx->shift = 0;
+	rx->nbits = 0;
+
+	if (sym == PD_K_EOP)
+		return rx_check(rx);
+
+	nibble = dec4b5b[sym];
+	if (nibble == 0xff)
+		return PD_PHY_RX_ERROR;
+
+	if (!rx->high) {
+		if (rx->len == PD_PHY_MAX_BYTES)
+			return PD_PHY_RX_ERROR;
+		rx->buf[rx->len] = nibble;
+	} else {
+		rx->buf[rx->len++] |= nibble << 4;
+	}
+
+	rx->high = !rx->high;
+	return PD_PHY_RX_MORE;
+}
+
+uint16_t PD_PHY_RAM_FUNC(pd_phy_rx_header)(const struct pd_phy_rx *rx)
+{
+	return rx->buf[0] | (rx->buf[1] << 8);
+}
+
+/* Returns the payload length in bytes */
+int PD_PHY_RAM_FUNC(pd_phy_rx_payload)(const struct pd_phy_rx *rx, uint32_t *payload)
+{
+	int len = rx->len - 2 - 4;
+
+	memcpy(payload, &rx->buf[2], len);
+	return len;
+}
@@ -0,0 +1,84 @@
+// USB-PD physical layer coding: 4b5b, CRC32, ordered sets and BMC
+
+#ifndef PD_PHY_H
+#define PD_PHY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Nothing in here touches the hardware, so that it can be exercised
+ * on the host against captured bitstreams.
+ */
+
+/* 4b5b K-codes, LSB transmitted first */
+#define PD_K_SYNC1	0x18
+#define PD_K_SYNC2	0x11
+#define PD_K_SYNC3	0x06
+#define PD_K_RST1	0x07
+#define PD_K_RST2	0x19
+#define PD_K_EOP	0x0d
+
+/* What came in, the SOP* ones matching the FUSB302 RX tokens */
+enum pd_phy_sop {
+	PD_PHY_SOP		= 0xe0,
+	PD_PHY_SOP1		= 0xc0,
+	PD_PHY_SOP2		= 0xa0,
+	PD_PHY_SOP1_DEBUG	= 0x80,
+	PD_PHY_SOP2_DEBUG	= 0x60,
+	PD_PHY_HARD_RESET	= 0x01,
+	PD_PHY_CABLE_RESET	= 0x02,
+};
+
+/* Header, 7 data objects and the CRC */
+#define PD_PHY_MAX_BYTES	(2 + 7 * 4 + 4)
+
+/*
+ * Worst case number of half-UI levels for a message: preamble, SOP*,
+ * 10 bits per byte, EOP, and the trailing edge.
+ */
+#define PD_PHY_PREAMBLE_BITS	64
+#define PD_PHY_MAX_HALFBITS	(2 * (PD_PHY_PREAMBLE_BITS + 20 +	\
+				      10 * PD_PHY_MAX_BYTES + 5 + 1))
+#define PD_PHY_TX_WORDS		((PD_PHY_MAX_HALFBITS + 31) / 32)
+
+struct pd_phy_tx {
+	uint32_t	buf[PD_PHY_TX_WORDS];
+	uint16_t	halfbits;
+	bool		level;
+};
+
+uint32_t pd_crc32(const uint8_t *buf, int len);
+
+/*
+ * BMC-encode a whole message into @tx as half-UI line levels, LSB
+ * first. Returns false for something that can't go on the wire.
+ */
+bool pd_phy_encode(struct pd_phy_tx *tx, enum pd_phy_sop sop,
+		   uint16_t header, const uint32_t *data);
+
+enum pd_phy_rx_status {
+	PD_PHY_RX_MORE,		/* Keep feeding bits */
+	PD_PHY_RX_DONE,		/* Good message, or a reset */
+	PD_PHY_RX_ERROR,	/* Give up on this one */
+};
+
+/* Receiver, fed with the bits recovered from the BMC by the PIO */
+struct pd_phy_rx {
+	uint32_t	shift;
+	uint8_t		state;
+	uint8_t		nbits;
+	uint8_t		len;
+	bool		high;
+	enum pd_phy_sop	sop;
+	uint8_t		buf[PD_PHY_MAX_BYTES];
+};
+
+void pd_phy_rx_reset(struct pd_phy_rx *rx);
+enum pd_phy_rx_status pd_phy_rx_bit(struct pd_phy_rx *rx, int bit);
+
+/* Once DONE, pick the message up (SOP* only) */
+uint16_t pd_phy_rx_header(const struct pd_phy_rx *rx);
+int pd_phy_rx_payload(const struct pd_phy_rx *rx, uint32_t *payload);
+
+#endif
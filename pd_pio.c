@@ -0,0 +1,504 @@
+// USB-PD PHY on PIO1 for port 0: the BMC goes in and out of the Pico,
+// and the FUSB302 is only left with CC detection, Rp, VCONN and VBUS.
+
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/pio.h"
+#include "m1-pd-bmc.h"
+#include "tcpm_driver.h"
+#include "FUSB302.h"
+#include "usb_pd_tcpm.h"
+#include "pd_phy.h"
+#include "pd_phy.pio.h"
+
+#define PD_PIO		pio1
+#define PD_PIO_IRQ	PIO1_IRQ_0
+#define PD_SM_TX	0
+#define PD_SM_RX	1
+
+/* tReceive: how long the GoodCRC has to come back */
+#define PD_PIO_GCRC_US		1100
+/* No bits for that long: end of message, or noise */
+#define PD_PIO_RX_IDLE_US	20
+
+#define PD_PIO_RXQ		4
+
+static struct {
+	bool			ready;
+	bool			rx_enable;
+	int16_t			polarity;
+	uint8_t			power_role;
+	uint8_t			data_role;
+	uint8_t			msgid;
+	uint8_t			tx_pin;
+	uint8_t			rx_pin;
+	uint8_t			tx_offset;
+	uint8_t			rx_offset;
+	int			dma;
+
+	/* Our own message, resent until the GoodCRC shows up */
+	struct pd_phy_tx	msg;
+	bool			msg_reset;
+	volatile bool		msg_pending;
+	bool			msg_retry;
+	uint16_t		msg_header;
+	uint8_t			msg_id;
+	uint8_t			tries;
+	uint8_t			done_tries;	/* Of the last one answered */
+	alarm_id_t		gcrc_alarm;
+
+	/* The next one, waiting for the line and for ours to be answered */
+	struct pd_phy_tx	next;
+	volatile bool		next_pending;
+	bool			next_reset;
+	uint16_t		next_header;
+	uint8_t			next_id;
+	uint16_t		last_header;	/* Last one handed to us */
+
+	/* The GoodCRC for what came in */
+	struct pd_phy_tx	gcrc;
+
+	const struct pd_phy_tx	* volatile sending;
+
+	struct pd_phy_rx	rx;
+	struct pd_msg		*rxq[PD_PIO_RXQ];
+	volatile uint8_t	rxq_head;
+	volatile uint8_t	rxq_tail;
+
+	/* What get_irq reports, with the FUSB302 bit values */
+	int16_t			irqa;
+	int16_t			irqb;
+} pd_pio;
+
+static void __not_in_flash_func(pd_pio_event)(int16_t irqa, int16_t irqb)
+{
+	pd_pio.irqa |= irqa;
+	pd_pio.irqb |= irqb;
+	m1_pd_bmc_wake(0, EVT_PD_IRQ);
+}
+
+static void __not_in_flash_func(pd_pio_rx_listen)(bool on)
+{
+	pio_set_irq0_source_enabled(PD_PIO,
+				    pis_sm0_rx_fifo_not_empty + PD_SM_RX, on);
+}
+
+static void __not_in_flash_func(pd_pio_tx_start)(const struct pd_phy_tx *tx)
+{
+	/* Don't listen to ourselves */
+	pd_pio_rx_listen(false);
+
+	pd_pio.sending = tx;
+	pio_sm_put(PD_PIO, PD_SM_TX, tx->halfbits - 1);
+	dma_channel_transfer_from_buffer_now(pd_pio.dma, tx->buf,
+					     (tx->halfbits + 31) / 32);
+}
+
+/* Start the waiting message, once the line and the GoodCRC wait are over */
+static void __not_in_flash_func(pd_pio_next)(void)
+{
+	if (!pd_pio.next_pending || pd_pio.sending || pd_pio.msg_pending)
+		return;
+
+	pd_pio.msg = pd_pio.next;
+	pd_pio.msg_header = pd_pio.next_header;
+	pd_pio.msg_id = pd_pio.next_id;
+	pd_pio.msg_reset = pd_pio.next_reset;
+	pd_pio.next_pending = false;
+
+	pd_pio.tries = 0;
+	pd_pio.msg_retry = false;
+	pd_pio.msg_pending = !pd_pio.msg_reset;
+	pd_pio_tx_start(&pd_pio.msg);
+}
+
+static void __not_in_flash_func(pd_pio_msg_done)(int16_t irqa)
+{
+	if (pd_pio.gcrc_alarm > 0)
+		cancel_alarm(pd_pio.gcrc_alarm);
+	pd_pio.gcrc_alarm = 0;
+	pd_pio.msg_pending = false;
+	pd_pio.msg_retry = false;
+	pd_pio.done_tries = pd_pio.tries;
+	pd_pio_event(irqa, 0);
+	pd_pio_next();
+}
+
+static int64_t pd_pio_gcrc_timeout(alarm_id_t id, void *data)
+{
+	pd_pio.gcrc_alarm = 0;
+	if (!pd_pio.msg_pending)
+		return 0;
+
+	if (pd_pio.tries++ >= PD_RETRY_COUNT) {
+		pd_pio_msg_done(TCPC_REG_INTERRUPTA_RETRYFAIL);
+		return 0;
+	}
+
+	/* A GoodCRC is on its way out, resend once it's gone */
+	if (pd_pio.sending)
+		pd_pio.msg_retry = true;
+	else
+		pd_pio_tx_start(&pd_pio.msg);
+
+	return 0;
+}
+
+static void __not_in_flash_func(pd_pio_tx_done)(void)
+{
+	const struct pd_phy_tx *tx = pd_pio.sending;
+
+	pd_pio.sending = NULL;
+
+	/* Whatever was heard in the meantime was us */
+	pio_sm_clear_fifos(PD_PIO, PD_SM_RX);
+	pd_pio_rx_listen(pd_pio.rx_enable);
+
+	if (tx == &pd_pio.gcrc) {
+		pd_pio_event(0, TCPC_REG_INTERRUPTB_GCRCSENT);
+		if (pd_pio.msg_retry) {
+			pd_pio.msg_retry = false;
+			pd_pio_tx_start(&pd_pio.msg);
+		}
+		pd_pio_next();
+		return;
+	}
+
+	if (pd_pio.msg_reset) {
+		pd_pio.msgid = 0;
+		pd_pio_event(TCPC_REG_INTERRUPTA_HARDSENT, 0);
+		pd_pio_next();
+		return;
+	}
+
+	pd_pio.gcrc_alarm = add_alarm_in_us(PD_PIO_GCRC_US, pd_pio_gcrc_timeout,
+					    NULL, true);
+}
+
+static void __not_in_flash_func(pd_pio_rx_done)(struct pd_phy_rx *rx)
+{
+	struct pd_msg *m;
+	uint8_t next;
+	int16_t hdr;
+
+	switch (rx->sop) {
+	case PD_PHY_HARD_RESET:
+		pd_pio.msgid = 0;
+		if (pd_pio.msg_pending)
+			pd_pio_msg_done(0);
+		pd_pio_event(TCPC_REG_INTERRUPTA_HARDRESET, 0);
+		return;
+	case PD_PHY_CABLE_RESET:
+		return;
+	default:
+		break;
+	}
+
+	hdr = pd_phy_rx_header(rx);
+	if (PACKET_IS_GOOD_CRC(hdr)) {
+		if (pd_pio.msg_pending && PD_HEADER_ID(hdr) == pd_pio.msg_id)
+			pd_pio_msg_done(TCPC_REG_INTERRUPTA_TX_SUCCESS);
+	} else {
+		/* The GoodCRC goes first, it has to be out within tTransmit */
+		pd_phy_encode(&pd_pio.gcrc, rx->sop,
+			      PD_HEADER(PD_CTRL_GOOD_CRC, pd_pio.power_role,
+					pd_pio.data_role, PD_HEADER_ID(hdr), 0,
+					PD_HEADER_REV(hdr), 0), NULL);
+		pd_pio_tx_start(&pd_pio.gcrc);
+
+		/* Our own message lost the race, the sender will start over */
+		if (pd_pio.msg_pending)
+			pd_pio_msg_done(TCPC_REG_INTERRUPTA_RETRYFAIL);
+	}
+
+	/* GoodCRCs are queued as well, for the trace */
+	next = (pd_pio.rxq_head + 1) % PD_PIO_RXQ;
+	if (next == pd_pio.rxq_tail)
+		return;
+
+	m = pd_msg_get();
+	if (!m)
+		return;
+
+	m->sop = rx->sop;
+	m->header = hdr;
+	pd_phy_rx_payload(rx, m->data);
+	pd_pio.rxq[pd_pio.rxq_head] = m;
+	pd_pio.rxq_head = next;
+}
+
+/*
+ * The RX SM hands over one bit per FIFO entry. Once the first one is
+ * in, stay here for the rest of the message, so that the GoodCRC can
+ * go out in time.
+ */
+static void __not_in_flash_func(pd_pio_rx)(void)
+{
+	enum pd_phy_rx_status st = PD_PHY_RX_MORE;
+	uint32_t last = time_us_32();
+
+	pd_phy_rx_reset(&pd_pio.rx);
+
+	while (st == PD_PHY_RX_MORE) {
+		if (pio_sm_is_rx_fifo_empty(PD_PIO, PD_SM_RX)) {
+			if (time_us_32() - last > PD_PIO_RX_IDLE_US)
+				return;
+			continue;
+		}
+
+		last = time_us_32();
+		st = pd_phy_rx_bit(&pd_pio.rx, pio_sm_get(PD_PIO, PD_SM_RX) & 1);
+	}
+
+	/* No GoodCRC for a bad message, the sender will try again */
+	if (st == PD_PHY_RX_DONE)
+		pd_pio_rx_done(&pd_pio.rx);
+}
+
+static void __not_in_flash_func(pd_pio_irq)(void)
+{
+	if (pio_interrupt_get(PD_PIO, PD_SM_TX)) {
+		pio_interrupt_clear(PD_PIO, PD_SM_TX);
+		pd_pio_tx_done();
+	}
+
+	if (pd_pio.rx_enable && !pd_pio.sending &&
+	    !pio_sm_is_rx_fifo_empty(PD_PIO, PD_SM_RX))
+		pd_pio_rx();
+}
+
+/* Point both SMs at the CC line in use */
+static void pd_pio_set_pins(int16_t polarity)
+{
+	const struct hw_context *hw = get_hw_from_port(0);
+
+	pio_sm_set_enabled(PD_PIO, PD_SM_TX, false);
+	pio_sm_set_enabled(PD_PIO, PD_SM_RX, false);
+	pio_sm_set_pindirs_with_mask(PD_PIO, PD_SM_TX, 0, 1u << pd_pio.tx_pin);
+
+	pd_pio.tx_pin = hw->pins[polarity ? PD_CC2_TX : PD_CC1_TX].pin;
+	pd_pio.rx_pin = hw->pins[polarity ? PD_CC2_RX : PD_CC1_RX].pin;
+	pd_pio.polarity = polarity;
+
+	pd_phy_tx_program_init(PD_PIO, PD_SM_TX, pd_pio.tx_offset, pd_pio.tx_pin);
+	pio_sm_clear_fifos(PD_PIO, PD_SM_RX);
+	pd_phy_rx_program_init(PD_PIO, PD_SM_RX, pd_pio.rx_offset, pd_pio.rx_pin);
+}
+
+/* Also reached after a warm restart, which doesn't go through init */
+static void pd_pio_hw_init(void)
+{
+	const struct hw_context *hw = get_hw_from_port(0);
+	dma_channel_config c;
+
+	if (pd_pio.ready)
+		return;
+
+	pio_sm_claim(PD_PIO, PD_SM_TX);
+	pio_sm_claim(PD_PIO, PD_SM_RX);
+	pd_pio.tx_offset = pio_add_program(PD_PIO, &pd_phy_tx_program);
+	pd_pio.rx_offset = pio_add_program(PD_PIO, &pd_phy_rx_program);
+	pd_pio.tx_pin = hw->pins[PD_CC1_TX].pin;
+	pd_pio_set_pins(0);
+
+	pd_pio.dma = dma_claim_unused_channel(true);
+	c = dma_channel_get_default_config(pd_pio.dma);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+	channel_config_set_read_increment(&c, true);
+	channel_config_set_write_increment(&c, false);
+	channel_config_set_dreq(&c, pio_get_dreq(PD_PIO, PD_SM_TX, true));
+	dma_channel_configure(pd_pio.dma, &c, &PD_PIO->txf[PD_SM_TX],
+			      NULL, 0, false);
+
+	pio_set_irq0_source_enabled(PD_PIO, pis_interrupt0 + PD_SM_TX, true);
+	irq_set_exclusive_handler(PD_PIO_IRQ, pd_pio_irq);
+	irq_set_enabled(PD_PIO_IRQ, true);
+
+	pd_pio.ready = true;
+}
+
+static int16_t pd_pio_init(int16_t port)
+{
+	int16_t ret = fusb302_tcpm_init(port);
+
+	pd_pio_hw_init();
+	return ret;
+}
+
+/* Drop everything, in and out */
+static void pd_pio_pd_reset(int16_t port)
+{
+	uint32_t flags;
+
+	fusb302_pd_reset(port);
+
+	flags = save_and_disable_interrupts();
+	if (pd_pio.gcrc_alarm > 0)
+		cancel_alarm(pd_pio.gcrc_alarm);
+	pd_pio.gcrc_alarm = 0;
+	pd_pio.msg_pending = false;
+	pd_pio.msg_retry = false;
+	pd_pio.next_pending = false;
+	pd_pio.msgid = 0;
+	while (pd_pio.rxq_tail != pd_pio.rxq_head) {
+		pd_msg_put(pd_pio.rxq[pd_pio.rxq_tail]);
+		pd_pio.rxq_tail = (pd_pio.rxq_tail + 1) % PD_PIO_RXQ;
+	}
+	restore_interrupts(flags);
+}
+
+static int16_t pd_pio_set_polarity(int16_t port, int16_t polarity)
+{
+	uint32_t flags;
+
+	/* VCONN goes on the other CC, and that's still the FUSB302's job */
+	fusb302_tcpm_set_polarity(port, polarity);
+	pd_pio_hw_init();
+
+	flags = save_and_disable_interrupts();
+	if (polarity != pd_pio.polarity && !pd_pio.sending)
+		pd_pio_set_pins(polarity);
+	restore_interrupts(flags);
+
+	return 0;
+}
+
+static int16_t pd_pio_set_msg_header(int16_t port, int16_t power_role,
+				     int16_t data_role)
+{
+	pd_pio.power_role = power_role;
+	pd_pio.data_role = data_role;
+	return 0;
+}
+
+static int16_t pd_pio_set_rx_enable(int16_t port, int16_t enable)
+{
+	/* Keep the FUSB302's own receiver and auto-GoodCRC out of it */
+	fusb302_tcpm_set_rx_enable(port, 0);
+	pd_pio_hw_init();
+
+	pd_pio.rx_enable = enable;
+	pio_sm_clear_fifos(PD_PIO, PD_SM_RX);
+	pd_pio_rx_listen(enable && !pd_pio.sending);
+
+	return 0;
+}
+
+static int16_t pd_pio_rx_fifo_is_empty(int16_t port)
+{
+	return pd_pio.rxq_head == pd_pio.rxq_tail;
+}
+
+static struct pd_msg *pd_pio_get_message(int16_t port)
+{
+	struct pd_msg *m;
+
+	if (pd_pio_rx_fifo_is_empty(port))
+		return NULL;
+
+	m = pd_pio.rxq[pd_pio.rxq_tail];
+	pd_pio.rxq_tail = (pd_pio.rxq_tail + 1) % PD_PIO_RXQ;
+
+	return m;
+}
+
+static int16_t pd_pio_transmit(int16_t port, enum tcpm_transmit_type type,
+			       uint16_t header, const uint32_t *data)
+{
+	static const enum pd_phy_sop sops[] = {
+		[TCPC_TX_SOP]			= PD_PHY_SOP,
+		[TCPC_TX_SOP_PRIME]		= PD_PHY_SOP1,
+		[TCPC_TX_SOP_PRIME_PRIME]	= PD_PHY_SOP2,
+		[TCPC_TX_SOP_DEBUG_PRIME]	= PD_PHY_SOP1_DEBUG,
+		[TCPC_TX_SOP_DEBUG_PRIME_PRIME]	= PD_PHY_SOP2_DEBUG,
+		[TCPC_TX_HARD_RESET]		= PD_PHY_HARD_RESET,
+		[TCPC_TX_CABLE_RESET]		= PD_PHY_CABLE_RESET,
+	};
+	uint32_t flags;
+
+	/* No BIST */
+	if (!pd_pio.ready || type >= ARRAY_SIZE(sops))
+		return EC_ERROR_UNIMPLEMENTED;
+
+	/*
+	 * Nothing waits here: the message goes out as soon as the line
+	 * is free and the previous one has been answered (or given up
+	 * on). There is room for one waiting.
+	 */
+	if (pd_pio.next_pending)
+		return EC_ERROR_BUSY;
+
+	flags = save_and_disable_interrupts();
+	pd_pio.next_reset = type >= TCPC_TX_HARD_RESET;
+	if (!pd_pio.next_reset) {
+		pd_pio.next_id = pd_pio.msgid;
+		header |= pd_pio.msgid << 9;
+		pd_pio.msgid = (pd_pio.msgid + 1) & 7;
+	}
+	pd_pio.next_header = header;
+	pd_pio.last_header = header;
+	restore_interrupts(flags);
+
+	/* Nobody else touches it until next_pending is set */
+	pd_phy_encode(&pd_pio.next, sops[type], header, data);
+
+	flags = save_and_disable_interrupts();
+
+	/* A reset doesn't wait for a GoodCRC */
+	if (pd_pio.next_reset && pd_pio.msg_pending) {
+		if (pd_pio.gcrc_alarm > 0)
+			cancel_alarm(pd_pio.gcrc_alarm);
+		pd_pio.gcrc_alarm = 0;
+		pd_pio.msg_pending = false;
+		pd_pio.msg_retry = false;
+	}
+
+	pd_pio.next_pending = true;
+	pd_pio_next();
+
+	restore_interrupts(flags);
+
+	return 0;
+}
+
+static void pd_pio_get_tx_status(int16_t port, uint16_t *header,
+				 uint8_t *retries)
+{
+	*header = pd_pio.last_header;
+	*retries = pd_pio.done_tries;
+}
+
+static void pd_pio_get_irq(int16_t port, int16_t *irq, int16_t *irqa,
+			   int16_t *irqb)
+{
+	uint32_t flags;
+
+	fusb302_get_irq(port, irq, irqa, irqb);
+
+	/* The FUSB302 doesn't see any PD traffic, only we do */
+	flags = save_and_disable_interrupts();
+	*irqa = (*irqa & (TCPC_REG_INTERRUPTA_OCP_TEMP |
+			  TCPC_REG_INTERRUPTA_TOGDONE)) | pd_pio.irqa;
+	*irqb = pd_pio.irqb;
+	pd_pio.irqa = pd_pio.irqb = 0;
+	restore_interrupts(flags);
+}
+
+const struct tcpm_drv pd_pio_tcpm_drv = {
+	.init			= pd_pio_init,
+	.pd_reset		= pd_pio_pd_reset,
+	.get_cc			= fusb302_tcpm_get_cc,
+	.get_vbus_level		= fusb302_tcpm_get_vbus_level,
+	.select_rp_value	= fusb302_tcpm_select_rp_value,
+	.set_cc			= fusb302_tcpm_set_cc,
+	.set_polarity		= pd_pio_set_polarity,
+	.set_vconn		= fusb302_tcpm_set_vconn,
+	.set_msg_header		= pd_pio_set_msg_header,
+	.set_rx_enable		= pd_pio_set_rx_enable,
+	.get_message		= pd_pio_get_message,
+	.transmit		= pd_pio_transmit,
+	.get_irq		= pd_pio_get_irq,
+	.rx_fifo_is_empty	= pd_pio_rx_fifo_is_empty,
+	.get_tx_status		= pd_pio_get_tx_status,
+};
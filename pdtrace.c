@@ -0,0 +1,178 @@
+// Binary trace of the USB-PD traffic, fetched by the host over EP0
+
+#include <string.h>
+
+#include "m1-pd-bmc.h"
+#include "tcpm_driver.h"
+#include "pdtrace.h"
+
+/* Power of two, so that the free-running indices wrap cleanly */
+#define PDTRACE_RING_SIZE	4096
+
+static struct {
+	uint8_t			ring[PDTRACE_RING_SIZE];
+	uint16_t		prod;
+	uint16_t		cons;
+	uint16_t		lost;
+	uint8_t			ports;
+
+	/* Sent, and waiting to hear whether it made it */
+	uint16_t		tx_header[CONFIG_USB_PD_PORT_COUNT];
+	uint8_t			tx_sop[CONFIG_USB_PD_PORT_COUNT];
+	bool			tx_pending[CONFIG_USB_PD_PORT_COUNT];
+} pdtrace;
+
+void pdtrace_enable(int port, bool on)
+{
+	if (on) {
+		pdtrace.ports |= 1U << port;
+	} else {
+		pdtrace.ports &= ~(1U << port);
+		pdtrace.tx_pending[port] = false;
+	}
+}
+
+bool pdtrace_enabled(int port)
+{
+	return pdtrace.ports & (1U << port);
+}
+
+static int pdtrace_room(void)
+{
+	return PDTRACE_RING_SIZE - (uint16_t)(pdtrace.prod - pdtrace.cons);
+}
+
+static void pdtrace_put(const void *rec, int len)
+{
+	const uint8_t *p = rec;
+
+	for (int i = 0; i < len; i++)
+		pdtrace.ring[(uint16_t)(pdtrace.prod + i) % PDTRACE_RING_SIZE] = p[i];
+	pdtrace.prod += len;
+}
+
+/* When the host can't keep up, say how much it missed */
+static void pdtrace_commit(const struct pdtrace_rec *rec)
+{
+	if (pdtrace.lost) {
+		struct pdtrace_rec lost = {
+			.len	= PDTRACE_REC_HDR,
+			.port	= rec->port,
+			.flags	= PDTRACE_F_LOST,
+			.header	= pdtrace.lost,
+			.us	= rec->us,
+		};
+
+		if (pdtrace_room() < lost.len + rec->len)
+			goto drop;
+
+		pdtrace_put(&lost, lost.len);
+		pdtrace.lost = 0;
+	}
+
+	if (pdtrace_room() < rec->len)
+		goto drop;
+
+	pdtrace_put(rec, rec->len);
+	return;
+drop:
+	if (pdtrace.lost < UINT16_MAX)
+		pdtrace.lost++;
+}
+
+static void pdtrace_fill(struct pdtrace_rec *rec, int port, uint8_t flags,
+			 enum pdtrace_sop sop, uint16_t header,
+			 const uint32_t *data)
+{
+	int cnt = sop < PDTRACE_HARD_RESET ? PD_HEADER_CNT(header) : 0;
+
+	*rec = (struct pdtrace_rec) {
+		.len	= PDTRACE_REC_HDR + 4 * cnt,
+		.port	= port,
+		.flags	= flags,
+		.sop	= sop,
+		.header	= header,
+		.us	= host_time_us(),
+	};
+
+	if (cnt)
+		memcpy(rec->data, data, 4 * cnt);
+}
+
+void pdtrace_rx(int port, enum pdtrace_sop sop, uint16_t header,
+		const uint32_t *data)
+{
+	struct pdtrace_rec rec;
+
+	if (!pdtrace_enabled(port))
+		return;
+
+	pdtrace_fill(&rec, port, 0, sop, header, data);
+	pdtrace_commit(&rec);
+}
+
+/*
+ * Recorded as it goes out, so that whatever answers it comes after it
+ * in the trace. The outcome follows in a record of its own.
+ */
+void pdtrace_tx(int port, enum pdtrace_sop sop, uint16_t header,
+		const uint32_t *data, uint64_t us)
+{
+	struct pdtrace_rec rec;
+
+	if (!pdtrace_enabled(port))
+		return;
+
+	pdtrace_fill(&rec, port, PDTRACE_F_TX, sop, header, data);
+	rec.us = us;
+	pdtrace_commit(&rec);
+
+	/* Nothing comes back for a reset */
+	pdtrace.tx_pending[port] = sop < PDTRACE_HARD_RESET;
+	pdtrace.tx_header[port] = header;
+	pdtrace.tx_sop[port] = sop;
+}
+
+/* Keyed to the message by its SOP* and header, MessageID included */
+void pdtrace_tx_done(int port, enum pdtrace_tx_result result,
+		     uint8_t retries)
+{
+	struct pdtrace_rec rec;
+
+	if (!pdtrace.tx_pending[port])
+		return;
+
+	rec = (struct pdtrace_rec) {
+		.len	= PDTRACE_REC_HDR,
+		.port	= port,
+		.flags	= PDTRACE_F_TX | PDTRACE_F_RESULT,
+		.sop	= pdtrace.tx_sop[port],
+		.result	= result,
+		.retries = retries,
+		.header	= pdtrace.tx_header[port],
+		.us	= host_time_us(),
+	};
+
+	pdtrace_commit(&rec);
+	pdtrace.tx_pending[port] = false;
+}
+
+int pdtrace_read(uint8_t *buf, int size)
+{
+	int len = 0;
+
+	while (pdtrace.cons != pdtrace.prod) {
+		uint8_t rl = pdtrace.ring[pdtrace.cons % PDTRACE_RING_SIZE];
+
+		if (len + rl > size)
+			break;
+
+		for (int i = 0; i < rl; i++)
+			buf[len + i] = pdtrace.ring[(uint16_t)(pdtrace.cons + i) %
+						    PDTRACE_RING_SIZE];
+		len += rl;
+		pdtrace.cons += rl;
+	}
+
+	return len;
+}
@@ -0,0 +1,61 @@
+// Binary trace of the USB-PD traffic, fetched by the host over EP0
+
+#ifndef PDTRACE_H
+#define PDTRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Capture format, as returned by CS_REQ_TRACE_READ: whole records
+ * back to back, little-endian. tools/pdtrace.c turns them into pcap.
+ */
+struct pdtrace_rec {
+	uint8_t		len;		/* Whole record, 16 + 4 * data objects */
+	uint8_t		port;
+	uint8_t		flags;		/* PDTRACE_F_* */
+	uint8_t		sop;		/* PDTRACE_SOP_* */
+	uint8_t		result;		/* PDTRACE_TX_*, RESULT only */
+	uint8_t		retries;	/* RESULT only, 0xff if the PHY can't tell */
+	uint16_t	header;		/* Number of records lost for LOST */
+	uint64_t	us;		/* Host time if the timebase was set */
+	uint32_t	data[7];	/* PD_HEADER_CNT(header) of them */
+} __attribute__((packed));
+
+#define PDTRACE_REC_HDR		16
+
+#define PDTRACE_F_TX		(1U << 0)
+#define PDTRACE_F_LOST		(1U << 1)	/* Ring was full, see header */
+#define PDTRACE_F_RESULT	(1U << 2)	/* Outcome of the last TX */
+
+/* Same numbering as enum tcpm_transmit_type */
+enum pdtrace_sop {
+	PDTRACE_SOP,
+	PDTRACE_SOP1,
+	PDTRACE_SOP2,
+	PDTRACE_SOP1_DEBUG,
+	PDTRACE_SOP2_DEBUG,
+	PDTRACE_HARD_RESET,
+	PDTRACE_CABLE_RESET,
+};
+
+enum pdtrace_tx_result {
+	PDTRACE_TX_NONE,		/* Not a RESULT record */
+	PDTRACE_TX_SUCCESS,		/* GoodCRC received */
+	PDTRACE_TX_FAILED,		/* Out of retries */
+};
+
+void pdtrace_enable(int port, bool on);
+bool pdtrace_enabled(int port);
+
+void pdtrace_rx(int port, enum pdtrace_sop sop, uint16_t header,
+		const uint32_t *data);
+void pdtrace_tx(int port, enum pdtrace_sop sop, uint16_t header,
+		const uint32_t *data, uint64_t us);
+void pdtrace_tx_done(int port, enum pdtrace_tx_result result,
+		     uint8_t retries);
+
+/* Fills @buf with as many whole records as fit, returns the length */
+int pdtrace_read(uint8_t *buf, int size);
+
+#endif
@@ -3,55 +3,127 @@
 #include <stddef.h>
 
 #include "bsp/board.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
 #include "tusb.h"
 #include "m1-pd-bmc.h"
 #include "FUSB302.h"
+#include "tcpm_driver.h"
+#include "swar.h"
+#include "uart.pio.h"
+
+/*
+ * Each port has a FUSB302 on an I2C bus (which several ports can
+ * share, each chip strapped to its own address), its interrupt, the
+ * VBUS switch, the target's UART and the SBU/USB serial muxes.
+ */
+#define PORT_PINS(sda, scl, irq, vbus, tx, rx, swap, sel, uart_fn)	\
+	[I2C_SDA] = {							\
+		.pin	= (sda),					\
+		.mode	= GPIO_FUNC_I2C,				\
+	},								\
+	[I2C_SCL] = {							\
+		.pin	= (scl),					\
+		.mode	= GPIO_FUNC_I2C,				\
+	},								\
+	[FUSB_INT] = {							\
+		.pin	= (irq),					\
+		.mode	= GPIO_FUNC_SIO,				\
+		.dir	= GPIO_IN,					\
+	},								\
+	[FUSB_VBUS] = {							\
+		.pin	= (vbus),					\
+		.mode	= GPIO_FUNC_SIO,				\
+		.dir	= GPIO_IN,					\
+	},								\
+	[UART_TX] = {							\
+		.pin	= (tx),						\
+		.mode	= (uart_fn),					\
+	},								\
+	[UART_RX] = {							\
+		.pin	= (rx),						\
+		.mode	= (uart_fn),					\
+	},								\
+	[SBU_SWAP] = {							\
+		.pin	= (swap),					\
+		.mode	= GPIO_FUNC_SIO,				\
+		.dir	= GPIO_OUT,					\
+	},								\
+	[SEL_USB] = {							\
+		.pin	= (sel),					\
+		.mode	= GPIO_FUNC_SIO,				\
+		.dir	= GPIO_OUT,					\
+	}
+
+#define PORT_FLOW_PINS(cts, rts)					\
+	[UART_CTS] = {							\
+		.pin	= (cts),					\
+		.mode	= GPIO_FUNC_UART,				\
+	},								\
+	[UART_RTS] = {							\
+		.pin	= (rts),					\
+		.mode	= GPIO_FUNC_UART,				\
+	}
+
+/*
+ * With the PIO PD PHY, each CC line has a TX pin driving it through
+ * the BMC transmitter (hi-Z when idle) and an RX pin fed by a slicer.
+ */
+#ifdef PD_PHY_PIO
+#ifdef UART_HW_FLOW
+#error "The PIO PD PHY uses the CTS/RTS pins"
+#endif
+#if CONFIG_USB_PD_PORT_COUNT > 2
+#error "The PIO PD PHY uses port 2's pins"
+#endif
+
+/*
+ * The PL011 IRQs preempt the PD receiver, whose FIFO only covers 8
+ * bits (27us). Past this rate, back to back runs of them could add
+ * up to more than that.
+ */
+#define PD_PHY_UART_BAUD_MAX	1000000
+
+#define PD_PHY_PINS(cc1_tx, cc1_rx, cc2_tx, cc2_rx)			\
+	[PD_CC1_TX] = {							\
+		.pin	= (cc1_tx),					\
+		.mode	= GPIO_FUNC_PIO1,				\
+	},								\
+	[PD_CC1_RX] = {							\
+		.pin	= (cc1_rx),					\
+		.mode	= GPIO_FUNC_PIO1,				\
+	},								\
+	[PD_CC2_TX] = {							\
+		.pin	= (cc2_tx),					\
+		.mode	= GPIO_FUNC_PIO1,				\
+	},								\
+	[PD_CC2_RX] = {							\
+		.pin	= (cc2_rx),					\
+		.mode	= GPIO_FUNC_PIO1,				\
+	}
+
+#define PORT0_TCPM	&pd_pio_tcpm_drv
+#else
+#define PORT0_TCPM	&fusb302_tcpm_drv
+#endif
 
 static const struct gpio_pin_config m1_pd_bmc_pin_config0[] = {
 	[M1_BMC_PIN_START ... M1_BMC_PIN_END] = {
 		.skip	= true,
 	},
+	/* I2C0, UART0 */
+	PORT_PINS(16, 17, 18, 26, 12, 13, 20, 7, GPIO_FUNC_UART),
 	[LED_G] = {
 		.pin	= 25,
 		.mode	= GPIO_FUNC_SIO,
 		.dir	= GPIO_OUT,
 	},
-	[I2C_SDA] = {		/* I2C0 */
-		.pin	= 16,
-		.mode	= GPIO_FUNC_I2C,
-	},
-	[I2C_SCL] = {		/* I2C0 */
-		.pin	= 17,
-		.mode	= GPIO_FUNC_I2C,
-	},
-	[FUSB_INT] = {
-		.pin	= 18,
-		.mode	= GPIO_FUNC_SIO,
-		.dir	= GPIO_IN,
-	},
-	[FUSB_VBUS] = {
-		.pin	= 26,
-		.mode	= GPIO_FUNC_SIO,
-		.dir	= GPIO_IN,
-	},
-	[UART_TX] = {		/* UART0 */
-		.pin	= 12,
-		.mode	= GPIO_FUNC_UART,
-	},
-	[UART_RX] = {		/* UART0 */
-		.pin	= 13,
-		.mode	= GPIO_FUNC_UART,
-	},
-	[SBU_SWAP] = {
-		.pin	= 20,
-		.mode	= GPIO_FUNC_SIO,
-		.dir	= GPIO_OUT,
-	},
-	[SEL_USB] = {
-		.pin	= 7,
-		.mode	= GPIO_FUNC_SIO,
-		.dir	= GPIO_OUT,
-	},
+#ifdef UART_HW_FLOW
+	PORT_FLOW_PINS(14, 15),
+#endif
+#ifdef PD_PHY_PIO
+	PD_PHY_PINS(10, 11, 14, 15),
+#endif
 };
 
 static const struct gpio_pin_config waveshare_2ch_rs232_config0[] = {
@@ -77,49 +149,50 @@ static const struct gpio_pin_config m1_pd_bmc_pin_config1[] = {
 	[M1_BMC_PIN_START ... M1_BMC_PIN_END] = {
 		.skip	= true,
 	},
-	[LED_G] = {
-		.pin	= 25,
-		.mode	= GPIO_FUNC_SIO,
-		.dir	= GPIO_OUT,
+	/* I2C1, UART1 */
+	PORT_PINS(22, 27, 19, 28, 8, 9, 21, 6, GPIO_FUNC_UART),
+#ifdef UART_HW_FLOW
+	PORT_FLOW_PINS(10, 11),
+#endif
+};
+
+/*
+ * Further ports share the I2C buses with the first two, and run their
+ * UART on PIO0 (two state machines each). A bare Pico runs out of
+ * GPIOs after the third one, boards exposing more can add theirs here.
+ */
+#if CONFIG_USB_PD_PORT_COUNT > 2
+#ifdef UART_HW_FLOW
+#error "Port 2 uses the CTS/RTS pins"
+#endif
+
+static const struct gpio_pin_config m1_pd_bmc_pin_config2[] = {
+	[M1_BMC_PIN_START ... M1_BMC_PIN_END] = {
 		.skip	= true,
 	},
-	[I2C_SDA] = {		/* I2C1 */
-		.pin	= 22,
-		.mode	= GPIO_FUNC_I2C,
-	},
-	[I2C_SCL] = {		/* I2C1 */
-		.pin	= 27,
-		.mode	= GPIO_FUNC_I2C,
-	},
-	[FUSB_INT] = {
-		.pin	= 19,
-		.mode	= GPIO_FUNC_SIO,
-		.dir	= GPIO_IN,
-	},
-	[FUSB_VBUS] = {
-		.pin	= 28,
-		.mode	= GPIO_FUNC_SIO,
-		.dir	= GPIO_IN,
-	},
-	[UART_TX] = {		/* UART1 */
-		.pin	= 8,
-		.mode	= GPIO_FUNC_UART,
-	},
-	[UART_RX] = {		/* UART1 */
-		.pin	= 9,
-		.mode	= GPIO_FUNC_UART,
-	},
-	[SBU_SWAP] = {
-		.pin	= 21,
-		.mode	= GPIO_FUNC_SIO,
-		.dir	= GPIO_OUT,
-	},
-	[SEL_USB] = {
-		.pin	= 6,
-		.mode	= GPIO_FUNC_SIO,
-		.dir	= GPIO_OUT,
-	},
+	/* I2C0 (shared with port 0), PIO0 SM0/1 */
+	PORT_PINS(16, 17, 10, 11, 2, 3, 14, 15, GPIO_FUNC_PIO0),
 };
+#endif
+
+#if CONFIG_USB_PD_PORT_COUNT < 2
+#error "Ports 0 and 1 are always there"
+#endif
+#if CONFIG_USB_PD_PORT_COUNT > 3
+#error "No pin table for port 3 and above"
+#endif
+
+#ifdef SERIAL_UPSTREAM_FLOW
+#ifdef UART_HW_FLOW
+#error "Port 1 uses the serial upstream CTS/RTS pins"
+#endif
+#ifdef PD_PHY_PIO
+#error "The PIO PD PHY uses the serial upstream CTS/RTS pins"
+#endif
+#if CONFIG_USB_PD_PORT_COUNT > 2
+#error "Port 2 uses the serial upstream CTS/RTS pins"
+#endif
+#endif
 
 static const struct gpio_pin_config waveshare_2ch_rs232_config1[] = {
 	[M1_BMC_PIN_START ... M1_BMC_PIN_END] = {
@@ -133,86 +206,718 @@ static const struct gpio_pin_config waveshare_2ch_rs232_config1[] = {
 		.pin	= 5,
 		.mode	= GPIO_FUNC_UART,
 	},
+#ifdef SERIAL_UPSTREAM_FLOW
+	PORT_FLOW_PINS(10, 11),
+#endif
 };
 
-static struct {
-	/*
-	 * we rely on prod/cons rollover behaviour, and buf must cover
-	 * the full range of prod/cons.
-	 */
-	uint8_t		prod;
-	uint8_t		cons;
-	char		buf[256];
-} uart1_buf;
+/*
+ * DUT output is stashed by the UART interrupt and pushed upstream by
+ * the main loop. We rely on the prod/cons rollover behaviour, with a
+ * buffer that is a power of two in size.
+ */
+#define UART_RX_BUF_BITS	13
+#define UART_RX_BUF_SIZE	(1 << UART_RX_BUF_BITS)
+
+/*
+ * RX FIFO interrupt levels we move between (1/8 and 3/4 full). The
+ * PL011 can't interrupt on a single byte with the FIFO on, and the RX
+ * timeout covers that case.
+ */
+#define UART_RX_LEVEL_MIN	0
+#define UART_RX_LEVEL_MAX	3
+
+/*
+ * Line start timestamps, in flight between the interrupt and the
+ * main loop. A power of two, smaller than the range of prod/cons.
+ */
+#define UART_RX_STAMPS		128
+
+struct uart_rx_stamp {
+	uint64_t		us;
+	uint16_t		pos;
+};
+
+struct uart_rx_state {
+	volatile uint16_t	prod;
+	volatile uint16_t	cons;
+	uint8_t			level;
+	enum uart_rx_mod	mode;
+	bool			stamp;		/* Shown upstream */
+	bool			record;		/* For m1_pd_bmc_uart_rx() */
+	bool			sol;
+	volatile uint8_t	stamp_prod;
+	volatile uint8_t	stamp_cons;
+	volatile uint32_t	good;
+	volatile uint32_t	errors;		/* Framing and breaks */
+	volatile uint32_t	lost;		/* Dropped or written over */
+	uint32_t		lost_shown;
+	struct uart_rx_stamp	stamps[UART_RX_STAMPS];
+	uint64_t		line_us;	/* Line being drained, 0 if unknown */
+	char			*buf;
+};
+
+static struct uart_rx_state uart_rx[CONFIG_USB_PD_PORT_COUNT];
+
+/* Aligned on their size, so that the PIO UART DMA can wrap around */
+static char uart_rx_buf[CONFIG_USB_PD_PORT_COUNT][UART_RX_BUF_SIZE]
+	__attribute__((aligned(UART_RX_BUF_SIZE)));
+
+/* Added to time_us_64() to get the host's idea of the time */
+static int64_t uart_timebase;
+
+static void uart_rx_set_level(const struct hw_context *hw,
+			      struct uart_rx_state *rx, uint8_t level)
+{
+	if (level == rx->level)
+		return;
+
+	rx->level = level;
+	/* The PIO UART interrupts on every byte, no knob to turn */
+	if (!hw->uart)
+		return;
+
+	hw_write_masked(&uart_get_hw(hw->uart)->ifls,
+			level << UART_UARTIFLS_RXIFLSEL_LSB,
+			UART_UARTIFLS_RXIFLSEL_BITS);
+}
+
+/*
+ * A burst that ends on the RX timeout is sparse (most likely
+ * interactive) traffic, so lower the FIFO threshold to get it out
+ * quickly. Hitting the threshold means bulk traffic, where taking
+ * fewer interrupts matters more.
+ */
+static void __not_in_flash_func(uart_rx_moderate)(const struct hw_context *hw,
+						  struct uart_rx_state *rx,
+						  bool timeout)
+{
+	uint8_t level = rx->level;
+
+	switch (rx->mode) {
+	case UART_RX_MOD_AUTO:
+	default:
+		if (timeout && level > UART_RX_LEVEL_MIN)
+			level--;
+		else if (!timeout && level < UART_RX_LEVEL_MAX)
+			level++;
+		break;
+	case UART_RX_MOD_LOW:
+		level = UART_RX_LEVEL_MIN;
+		break;
+	case UART_RX_MOD_HIGH:
+		level = UART_RX_LEVEL_MAX;
+		break;
+	}
+
+	uart_rx_set_level(hw, rx, level);
+}
+
+/* Record the time at which a line starts at @pos */
+static inline void __not_in_flash_func(uart_rx_sol)(struct uart_rx_state *rx,
+						    uint16_t pos, char c)
+{
+	if ((rx->stamp || rx->record) && rx->sol &&
+	    (uint8_t)(rx->stamp_prod - rx->stamp_cons) < UART_RX_STAMPS) {
+		rx->stamps[rx->stamp_prod % UART_RX_STAMPS] = (struct uart_rx_stamp) {
+			.us	= time_us_64(),
+			.pos	= pos,
+		};
+		rx->stamp_prod++;
+	}
+
+	rx->sol = (c == '\n');
+}
+
+static inline void __not_in_flash_func(uart_rx_put)(struct uart_rx_state *rx,
+						    char c)
+{
+	/* Oops, we're losing data... */
+	if ((uint16_t)(rx->prod - rx->cons) == UART_RX_BUF_SIZE) {
+		rx->lost++;
+		return;
+	}
+
+	uart_rx_sol(rx, rx->prod, c);
+	rx->buf[rx->prod % UART_RX_BUF_SIZE] = c;
+	rx->prod++;
+}
 
 static void __not_in_flash_func(uart_irq_fn)(int port,
 					     const struct hw_context *hw)
 {
+	struct uart_rx_state *rx = &uart_rx[port];
+	bool timeout;
+
+	timeout = uart_get_hw(hw->uart)->mis & UART_UARTMIS_RTMIS_BITS;
+
 	while (uart_is_readable(hw->uart)) {
-		const char c = uart_getc(hw->uart);
-		upstream_ops->tx_bytes(port, &c, 1);
+		const uint32_t dr = uart_get_hw(hw->uart)->dr;
+
+		if (dr & (UART_UARTDR_FE_BITS | UART_UARTDR_BE_BITS))
+			rx->errors++;
+		else
+			rx->good++;
+
+		uart_rx_put(rx, dr);
+	}
+
+	uart_rx_moderate(hw, rx, timeout);
+	m1_pd_bmc_wake(port, EVT_UART_RX);
+}
+
+/*
+ * PIO UARTs move their data with DMA. RX lands straight into the
+ * port's RX ring, which the channel wraps around, and TX drains a
+ * ring of its own, one contiguous chunk at a time. Nothing interrupts
+ * on RX: a timer follows the DMA write pointer instead, and wakes the
+ * main loop when it has moved. Line timestamps are taken there too,
+ * so they are only good to PIO_UART_POLL_US.
+ */
+#define PIO_UART_TX_SIZE	1024
+#define PIO_UART_POLL_US	500
+
+/* Slowest and fastest rates the 16.8 PIO clock divider can do */
+#define PIO_UART_DIV_MAX	65536
+#define PIO_UART_CYCLES		8	/* Per bit, see uart.pio */
+
+static struct pio_uart {
+	int			rx_chan;
+	int			tx_chan;
+	uint32_t		baud;
+	volatile uint16_t	tx_prod;
+	volatile uint16_t	tx_cons;
+	volatile uint16_t	tx_len;		/* In flight */
+	char			tx_buf[PIO_UART_TX_SIZE];
+} pio_uart[CONFIG_USB_PD_PORT_COUNT];
+
+static repeating_timer_t pio_uart_timer;
+
+static void __not_in_flash_func(pio_uart_rx_poll)(int port,
+						  const struct hw_context *hw)
+{
+	struct uart_rx_state *rx = &uart_rx[port];
+	const uint sm = hw->sm + 1;
+	/* Where "irq 4 rel" lands for this SM */
+	const uint32_t err = 1U << (4 + sm);
+	uint16_t prod, off;
+
+	if (hw->pio->irq & err) {
+		hw->pio->irq = err;
+		rx->errors++;
+	}
+
+	off = ((uintptr_t)dma_channel_hw_addr(pio_uart[port].rx_chan)->write_addr -
+	       (uintptr_t)rx->buf);
+	prod = rx->prod + ((uint16_t)(off - rx->prod) % UART_RX_BUF_SIZE);
+	if (prod == rx->prod)
+		return;
+
+	rx->good += (uint16_t)(prod - rx->prod);
+	if (rx->stamp || rx->record) {
+		for (uint16_t pos = rx->prod; pos != prod; pos++)
+			uart_rx_sol(rx, pos, rx->buf[pos % UART_RX_BUF_SIZE]);
+	}
+
+	rx->prod = prod;
+	m1_pd_bmc_wake(port, EVT_UART_RX);
+}
+
+static bool __not_in_flash_func(pio_uart_poll)(repeating_timer_t *t)
+{
+	for (int i = 0; i < CONFIG_USB_PD_PORT_COUNT; i++) {
+		const struct hw_context *hw = get_hw_from_port(i);
+
+		if (hw && hw->pio)
+			pio_uart_rx_poll(i, hw);
+	}
+
+	return true;
+}
+
+/* Start on the next contiguous chunk of the TX ring, if idle */
+static void __not_in_flash_func(pio_uart_tx_kick)(struct pio_uart *pu)
+{
+	uint16_t idx, len;
+
+	if (pu->tx_len || pu->tx_prod == pu->tx_cons)
+		return;
+
+	idx = pu->tx_cons % PIO_UART_TX_SIZE;
+	len = MIN((uint16_t)(pu->tx_prod - pu->tx_cons),
+		  PIO_UART_TX_SIZE - idx);
+	pu->tx_len = len;
+	dma_channel_transfer_from_buffer_now(pu->tx_chan, &pu->tx_buf[idx], len);
+}
+
+static void __not_in_flash_func(pio_uart_dma_irq)(void)
+{
+	for (int i = 0; i < CONFIG_USB_PD_PORT_COUNT; i++) {
+		struct pio_uart *pu = &pio_uart[i];
+
+		if (!pu->baud)
+			continue;
+
+		if (dma_channel_get_irq1_status(pu->tx_chan)) {
+			dma_channel_acknowledge_irq1(pu->tx_chan);
+			pu->tx_cons += pu->tx_len;
+			pu->tx_len = 0;
+			pio_uart_tx_kick(pu);
+		}
+
+		/* 4G characters later, carry on around the ring */
+		if (dma_channel_get_irq1_status(pu->rx_chan)) {
+			dma_channel_acknowledge_irq1(pu->rx_chan);
+			dma_channel_set_trans_count(pu->rx_chan, ~0U, true);
+		}
+	}
+}
+
+static uint32_t pio_uart_set_baud(const struct hw_context *hw, uint32_t baud)
+{
+	uint32_t clk = clock_get_hz(clk_sys);
+	float div = (float)clk / (PIO_UART_CYCLES * baud);
+
+	if (div < 1 || div >= PIO_UART_DIV_MAX)
+		return 0;
+
+	pio_sm_set_clkdiv(hw->pio, hw->sm, div);
+	pio_sm_set_clkdiv(hw->pio, hw->sm + 1, div);
+
+	return clk / (PIO_UART_CYCLES * div);
+}
+
+/* Keep whatever fills the RX ring out of the way */
+static uint32_t uart_rx_lock(const struct hw_context *hw)
+{
+	/* That's the timer for a PIO UART, hit them all */
+	if (hw->pio)
+		return save_and_disable_interrupts();
+
+	irq_set_enabled(hw->uart_irq, false);
+	return 0;
+}
+
+static void uart_rx_unlock(const struct hw_context *hw, uint32_t flags)
+{
+	if (hw->pio)
+		restore_interrupts(flags);
+	else
+		irq_set_enabled(hw->uart_irq, true);
+}
+
+void uart_set_rx_mod(int32_t port, enum uart_rx_mod mode)
+{
+	struct uart_rx_state *rx = &uart_rx[port];
+	const struct hw_context *hw = get_hw_from_port(port);
+	uint32_t flags;
+
+	if (!hw)
+		return;
+
+	flags = uart_rx_lock(hw);
+	rx->mode = mode;
+	if (mode != UART_RX_MOD_AUTO)
+		uart_rx_moderate(hw, rx, false);
+	uart_rx_unlock(hw, flags);
+}
+
+void uart_set_timestamps(int32_t port, bool on)
+{
+	const struct hw_context *hw = get_hw_from_port(port);
+	uint32_t flags;
+
+	if (!hw)
+		return;
+
+	flags = uart_rx_lock(hw);
+	uart_rx[port].stamp = on;
+	uart_rx[port].sol = true;
+	uart_rx[port].stamp_cons = uart_rx[port].stamp_prod;
+	uart_rx_unlock(hw, flags);
+}
+
+/*
+ * Keep the line start stamps for m1_pd_bmc_uart_rx() even when they
+ * aren't shown, the next byte starting a line.
+ */
+void uart_rx_record(int32_t port, bool on)
+{
+	const struct hw_context *hw = get_hw_from_port(port);
+	uint32_t flags;
+
+	if (!hw)
+		return;
+
+	flags = uart_rx_lock(hw);
+	uart_rx[port].record = on;
+	uart_rx[port].sol = true;
+	uart_rx_unlock(hw, flags);
+}
+
+uint32_t uart_set_baud(int32_t port, uint32_t baud)
+{
+	const struct hw_context *hw = get_hw_from_port(port);
+	uint32_t actual;
+
+	if (!hw || !baud)
+		return 0;
+
+#ifdef PD_PHY_PIO
+	if (!hw->pio)
+		baud = MIN(baud, PD_PHY_UART_BAUD_MAX);
+#endif
+
+	if (hw->pio) {
+		actual = pio_uart_set_baud(hw, baud);
+		if (actual)
+			pio_uart[port].baud = actual;
+		return actual;
+	}
+
+	return uart_set_baudrate(hw->uart, baud);
+}
+
+uint32_t uart_get_baud(int32_t port)
+{
+	const struct hw_context *hw = get_hw_from_port(port);
+	const uart_hw_t *uart;
+
+	if (!hw)
+		return 0;
+
+	if (hw->pio)
+		return pio_uart[port].baud;
+
+	/* Back from the PL011 divisors, as in uart_set_baudrate() */
+	uart = uart_get_hw(hw->uart);
+	return (4 * clock_get_hz(clk_peri)) / (64 * uart->ibrd + uart->fbrd);
+}
+
+bool uart_get_timestamps(int32_t port)
+{
+	return uart_rx[port].stamp;
+}
+
+void uart_rx_stats(int32_t port, uint32_t *good, uint32_t *errors,
+		  uint32_t *lost)
+{
+	*good = uart_rx[port].good;
+	*errors = uart_rx[port].errors;
+	*lost = uart_rx[port].lost;
+}
+
+void uart_set_timebase(uint64_t us)
+{
+	uart_timebase = us - time_us_64();
+}
+
+uint64_t host_time_us(void)
+{
+	return time_us_64() + uart_timebase;
+}
+
+static void uart_rx_tx_stamp(int32_t port, uint64_t us)
+{
+	char str[32];
+	int len;
+
+	us += uart_timebase;
+	len = snprintf(str, sizeof(str), "[%5llu.%06llu] ",
+		       us / 1000000, us % 1000000);
+	upstream_ops->tx_bytes(port, str, len);
+}
+
+/* Push up to budget bytes upstream, returns true if more are pending */
+bool uart_rx_drain(int32_t port, int budget)
+{
+	struct uart_rx_state *rx = &uart_rx[port];
+	uint16_t prod = rx->prod;
+
+	/* The PIO UART DMA doesn't wait, skip what it wrote over */
+	if ((uint16_t)(prod - rx->cons) > UART_RX_BUF_SIZE) {
+		rx->lost += (uint16_t)(prod - rx->cons) - UART_RX_BUF_SIZE;
+		rx->cons = prod - UART_RX_BUF_SIZE;
+		rx->line_us = 0;
+		while (rx->stamp_cons != rx->stamp_prod &&
+		       (int16_t)(rx->stamps[rx->stamp_cons % UART_RX_STAMPS].pos -
+				 rx->cons) < 0)
+			rx->stamp_cons++;
+	}
+
+	/* Say so in the output, unless that would corrupt it */
+	if (rx->lost != rx->lost_shown && !upstream_get_raw(port)) {
+		char note[48];
+		int len;
+
+		len = snprintf(note, sizeof(note), "[%lu bytes of DUT output lost]\n\r",
+			       rx->lost - rx->lost_shown);
+		upstream_ops->tx_bytes(port, note, len);
+		rx->lost_shown = rx->lost;
 	}
+
+	while (rx->cons != prod && budget > 0) {
+		uint16_t idx = rx->cons % UART_RX_BUF_SIZE;
+		uint16_t len = MIN((uint16_t)(prod - rx->cons),
+				   UART_RX_BUF_SIZE - idx);
+
+		len = MIN(len, budget);
+
+		/* Stop at the next line start, and stamp it */
+		if (rx->stamp_cons != rx->stamp_prod) {
+			struct uart_rx_stamp *st;
+			uint16_t off;
+
+			st = &rx->stamps[rx->stamp_cons % UART_RX_STAMPS];
+			off = st->pos - rx->cons;
+			if (!off) {
+				if (rx->stamp && !upstream_get_raw(port))
+					uart_rx_tx_stamp(port, st->us);
+				rx->line_us = st->us;
+				rx->stamp_cons++;
+				continue;
+			}
+
+			len = MIN(len, off);
+		}
+
+		m1_pd_bmc_uart_rx(port, &rx->buf[idx], len, rx->line_us);
+		upstream_ops->tx_bytes(port, &rx->buf[idx], len);
+		/* The next line may not have made it into the stamp ring */
+		if (rx->buf[idx + len - 1] == '\n')
+			rx->line_us = 0;
+		rx->cons += len;
+		budget -= len;
+	}
+
+	return rx->cons != rx->prod;
 }
 
 static void uart0_irq_fn(void);
 static void uart1_irq_fn(void);
 
-static const struct hw_context hw0 = {
-	.pins		= m1_pd_bmc_pin_config0,
-	.nr_pins	= ARRAY_SIZE(m1_pd_bmc_pin_config0),
-	.uart		= uart0,
-	.uart_irq	= UART0_IRQ,
-	.uart_handler	= uart0_irq_fn,
-	.i2c		= i2c0,
-	.addr		= fusb302_I2C_SLAVE_ADDR,
+static bool clk_ok;
+
+static const struct hw_context port_hw[CONFIG_USB_PD_PORT_COUNT] = {
+	{
+		.pins		= m1_pd_bmc_pin_config0,
+		.nr_pins	= ARRAY_SIZE(m1_pd_bmc_pin_config0),
+		.uart		= uart0,
+		.uart_irq	= UART0_IRQ,
+		.uart_handler	= uart0_irq_fn,
+		.tcpm		= PORT0_TCPM,
+		.i2c		= i2c0,
+		.addr		= fusb302_I2C_SLAVE_ADDR,
+	},
+	{
+		.pins		= m1_pd_bmc_pin_config1,
+		.nr_pins	= ARRAY_SIZE(m1_pd_bmc_pin_config1),
+		.uart		= uart1,
+		.uart_irq	= UART1_IRQ,
+		.uart_handler	= uart1_irq_fn,
+		.tcpm		= &fusb302_tcpm_drv,
+		.i2c		= i2c1,
+		.addr		= fusb302_I2C_SLAVE_ADDR,
+	},
+#if CONFIG_USB_PD_PORT_COUNT > 2
+	{
+		.pins		= m1_pd_bmc_pin_config2,
+		.nr_pins	= ARRAY_SIZE(m1_pd_bmc_pin_config2),
+		.pio		= pio0,
+		.sm		= 0,
+		.tcpm		= &fusb302_tcpm_drv,
+		.i2c		= i2c0,
+		.addr		= fusb302_I2C_SLAVE_ADDR_B01,
+	},
+#endif
+};
+
+/* Port 1 once UART1 has become the serial upstream link */
+static const struct gpio_pin_config m1_pd_bmc_pin_config1_pio[] = {
+	[M1_BMC_PIN_START ... M1_BMC_PIN_END] = {
+		.skip	= true,
+	},
+	/* I2C1, PIO0 SM2/3 */
+	PORT_PINS(22, 27, 19, 28, 8, 9, 21, 6, GPIO_FUNC_PIO0),
 };
 
-static const struct hw_context hw1 = {
-	.pins		= m1_pd_bmc_pin_config1,
-	.nr_pins	= ARRAY_SIZE(m1_pd_bmc_pin_config1),
-	.uart		= uart1,
-	.uart_irq	= UART1_IRQ,
-	.uart_handler	= uart1_irq_fn,
+static const struct hw_context port1_pio_hw = {
+	.pins		= m1_pd_bmc_pin_config1_pio,
+	.nr_pins	= ARRAY_SIZE(m1_pd_bmc_pin_config1_pio),
+	.pio		= pio0,
+	.sm		= 2,
+	.tcpm		= &fusb302_tcpm_drv,
 	.i2c		= i2c1,
 	.addr		= fusb302_I2C_SLAVE_ADDR,
 };
 
 static void __not_in_flash_func(uart0_irq_fn)(void)
 {
-	uart_irq_fn(0, &hw0);
+	uart_irq_fn(0, &port_hw[0]);
 }
 
 static void __not_in_flash_func(uart1_irq_fn)(void)
 {
-	if (!upstream_is_serial()) {
-		uart_irq_fn(1, &hw1);
+	/* The serial upstream link is all DMA */
+	if (upstream_is_serial())
+		return;
+
+	uart_irq_fn(1, &port_hw[1]);
+}
+
+bool uart_tx_ready(int32_t port)
+{
+	const struct hw_context *hw = get_hw_from_port(port);
+	struct pio_uart *pu = &pio_uart[port];
+
+	if (hw->pio)
+		return (uint16_t)(pu->tx_prod - pu->tx_cons) < PIO_UART_TX_SIZE;
+
+	return uart_is_writable(hw->uart);
+}
+
+void uart_tx_bytes(int32_t port, const char *ptr, int len)
+{
+	const struct hw_context *hw = get_hw_from_port(port);
+	struct pio_uart *pu = &pio_uart[port];
+
+	if (!hw->pio) {
+		uart_write_blocking(hw->uart, (const uint8_t *)ptr, len);
+		return;
+	}
+
+	while (len > 0) {
+		uint16_t room = PIO_UART_TX_SIZE - (uint16_t)(pu->tx_prod - pu->tx_cons);
+
+		/* Wait for the DMA to make some room, like a PL011 would */
+		if (!room) {
+			tight_loop_contents();
+			continue;
+		}
+
+		room = MIN(room, len);
+		for (int i = 0; i < room; i++)
+			pu->tx_buf[(pu->tx_prod + i) % PIO_UART_TX_SIZE] = ptr[i];
+
+		ptr += room;
+		len -= room;
+
+		irq_set_enabled(DMA_IRQ_1, false);
+		pu->tx_prod += room;
+		pio_uart_tx_kick(pu);
+		irq_set_enabled(DMA_IRQ_1, true);
+	}
+}
+
+void uart_tx_break(int32_t port, bool on)
+{
+	const struct hw_context *hw = get_hw_from_port(port);
+	const struct gpio_pin_config *tx = &hw->pins[UART_TX];
+
+	if (!hw->pio) {
+		uart_set_break(hw->uart, on);
 		return;
 	}
 
-	while (uart_is_readable(uart1)) {
-		uart1_buf.buf[uart1_buf.prod++] = uart_getc(uart1);
+	/* Take the pin away from the PIO for as long as the break lasts */
+	if (on) {
+		gpio_put(tx->pin, 0);
+		gpio_set_dir(tx->pin, GPIO_OUT);
+		gpio_set_function(tx->pin, GPIO_FUNC_SIO);
+	} else {
+		gpio_set_function(tx->pin, tx->mode);
+	}
+}
 
-		/* Oops, we're losing data... */
-		if (uart1_buf.prod == uart1_buf.cons)
-			uart1_buf.cons++;
+static void pio_uart_init(int port, const struct hw_context *hw)
+{
+	struct pio_uart *pu = &pio_uart[port];
+	struct uart_rx_state *rx = &uart_rx[port];
+	const uint sm_rx = hw->sm + 1;
+	dma_channel_config c;
+	static int tx_offset[NUM_PIOS] = { [0 ... NUM_PIOS - 1] = -1 };
+	static int rx_offset[NUM_PIOS];
+	uint idx = pio_get_index(hw->pio);
+
+	/* Both programs are shared by all the UARTs on this PIO */
+	if (tx_offset[idx] < 0) {
+		tx_offset[idx] = pio_add_program(hw->pio, &pio_uart_tx_program);
+		rx_offset[idx] = pio_add_program(hw->pio, &pio_uart_rx_program);
 	}
+
+	pio_sm_claim(hw->pio, hw->sm);
+	pio_sm_claim(hw->pio, hw->sm + 1);
+	pio_uart_tx_program_init(hw->pio, hw->sm, tx_offset[idx],
+				 hw->pins[UART_TX].pin, 115200);
+	pio_uart_rx_program_init(hw->pio, sm_rx, rx_offset[idx],
+				 hw->pins[UART_RX].pin, 115200);
+	pu->baud = 115200;
+
+	/* The data is in the top byte of the RX FIFO entries */
+	pu->rx_chan = dma_claim_unused_channel(true);
+	c = dma_channel_get_default_config(pu->rx_chan);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, true);
+	channel_config_set_ring(&c, true, UART_RX_BUF_BITS);
+	channel_config_set_dreq(&c, pio_get_dreq(hw->pio, sm_rx, false));
+	dma_channel_configure(pu->rx_chan, &c, rx->buf,
+			      (io_rw_8 *)&hw->pio->rxf[sm_rx] + 3, ~0U, true);
+
+	pu->tx_chan = dma_claim_unused_channel(true);
+	c = dma_channel_get_default_config(pu->tx_chan);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+	channel_config_set_read_increment(&c, true);
+	channel_config_set_write_increment(&c, false);
+	channel_config_set_dreq(&c, pio_get_dreq(hw->pio, hw->sm, true));
+	dma_channel_configure(pu->tx_chan, &c, &hw->pio->txf[hw->sm],
+			      NULL, 0, false);
+
+	dma_channel_set_irq1_enabled(pu->rx_chan, true);
+	dma_channel_set_irq1_enabled(pu->tx_chan, true);
+	irq_set_exclusive_handler(DMA_IRQ_1, pio_uart_dma_irq);
+	irq_set_enabled(DMA_IRQ_1, true);
+
+	if (!pio_uart_timer.alarm_id)
+		add_repeating_timer_us(-PIO_UART_POLL_US, pio_uart_poll,
+				       NULL, &pio_uart_timer);
 }
 
-static void init_system(const struct hw_context *hw)
+static void init_system(int port, const struct hw_context *hw)
 {
-	i2c_init(hw->i2c, 400 * 1000);
+	static uint8_t i2c_ready;
+	uint8_t i2c_bit = 1U << i2c_hw_index(hw->i2c);
+
+	/* Ports sharing a bus only initialise it once */
+	if (!(i2c_ready & i2c_bit)) {
+		i2c_init(hw->i2c, 400 * 1000);
+		i2c_ready |= i2c_bit;
+	}
+
+	uart_rx[port].buf = uart_rx_buf[port];
+
+	if (hw->pio) {
+		pio_uart_init(port, hw);
+		return;
+	}
 
 	uart_init(hw->uart, 115200);
-	uart_set_hw_flow(hw->uart, false, false);
+	/* Only if the board has the CTS/RTS lines wired up */
+	uart_set_hw_flow(hw->uart,
+			 !hw->pins[UART_CTS].skip, !hw->pins[UART_RTS].skip);
 	uart_set_fifo_enabled(hw->uart, true);
 	irq_set_exclusive_handler(hw->uart_irq, hw->uart_handler);
+#ifdef PD_PHY_PIO
+	/* Ahead of the PD PHY, which stays in its IRQ for a whole message */
+	irq_set_priority(hw->uart_irq, PICO_HIGHEST_IRQ_PRIORITY);
+#endif
 	irq_set_enabled(hw->uart_irq, true);
 	uart_set_irq_enables(hw->uart, true, false);
 
-	/* Interrupt when the RX FIFO is 3/4 full */
+	/* Start low, and let uart_rx_moderate() adjust to the traffic */
 	hw_write_masked(&uart_get_hw(hw->uart)->ifls,
-			3 << UART_UARTIFLS_RXIFLSEL_LSB,
-                        UART_UARTIFLS_RXIFLSEL_BITS);
+			UART_RX_LEVEL_MIN << UART_UARTIFLS_RXIFLSEL_LSB,
+			UART_UARTIFLS_RXIFLSEL_BITS);
 }
 
 static void m1_pd_bmc_gpio_setup_one(const struct gpio_pin_config *pin)
@@ -230,12 +935,17 @@ static void m1_pd_bmc_gpio_setup_one(const struct gpio_pin_config *pin)
 		gpio_pull_up(pin->pin);
 }
 
-static void m1_pd_bmc_system_init(const struct hw_context *hw)
+/* On a warm restart, VBUS and the serial routing are already set up */
+static void m1_pd_bmc_system_init(int port, const struct hw_context *hw,
+				  bool warm)
 {
-	init_system(hw);
+	init_system(port, hw);
 
-	for (unsigned int i = 0; i < hw->nr_pins; i++)
+	for (unsigned int i = 0; i < hw->nr_pins; i++) {
+		if (warm && (i == FUSB_VBUS || i == SBU_SWAP || i == SEL_USB))
+			continue;
 		m1_pd_bmc_gpio_setup_one(&hw->pins[i]);
+	}
 }
 
 static bool apply_waveshare_2ch_rs232_overrides(void)
@@ -258,15 +968,177 @@ static bool apply_waveshare_2ch_rs232_overrides(void)
 	return true;
 }
 
+/*
+ * Console output is coalesced into full USB packets (the CDC layer
+ * pushes a packet out as soon as it has enough data for it). Whatever
+ * is left in the FIFO gets flushed once the oldest pending byte has
+ * been waiting for USB_TX_LATENCY_US, so that interactive echo stays
+ * snappy while bulk output goes out in full packets.
+ */
+#ifndef USB_TX_LATENCY_US
+#define USB_TX_LATENCY_US	500
+#endif
+
+/*
+ * Whatever is sent while the host doesn't have the port open goes
+ * into a backlog (the oldest data being dropped when it overflows).
+ * Opening the port replays the banner and then the backlog, so that
+ * nothing the Mac said while the host was away is lost.
+ */
+#ifndef USB_BACKLOG_SIZE
+#define USB_BACKLOG_SIZE	4096
+#endif
+
+enum usb_replay {
+	USB_REPLAY_NONE,
+	USB_REPLAY_BANNER,
+	USB_REPLAY_BACKLOG,
+};
+
+static struct usb_tx_state {
+	volatile bool	armed;
+	volatile bool	expired;
+	bool		open;
+	uint8_t		replay;
+	uint16_t	banner_len;
+	uint16_t	banner_pos;
+	uint16_t	prod;
+	uint16_t	cons;
+	uint32_t	lost;
+	char		banner[256];
+	char		backlog[USB_BACKLOG_SIZE];
+} usb_tx[CFG_TUD_CDC];
+
+static uint64_t boot_us[BOOT_NR_EVENTS][CONFIG_USB_PD_PORT_COUNT];
+
+/* Only the first occurrence of each event counts */
+void boot_mark(enum boot_event ev, int32_t port)
+{
+	if (!boot_us[ev][port])
+		boot_us[ev][port] = time_us_64();
+}
+
+int boot_format(int32_t port, char *buf, int size)
+{
+	static const char *names[] = {
+		[BOOT_USB_MOUNT]	= "USB",
+		[BOOT_PD_READY]		= "FUSB302",
+		[BOOT_SERIAL]		= "serial",
+		[BOOT_HOST_OPEN]	= "host",
+	};
+	int len;
+
+	len = snprintf(buf, size, "Boot (ms):");
+	for (int i = 0; i < BOOT_NR_EVENTS && len < size; i++) {
+		/* USB is for the whole device, not per port */
+		uint64_t us = boot_us[i][i == BOOT_USB_MOUNT ? 0 : port];
+
+		if (us)
+			len += snprintf(buf + len, size - len, " %s %llu",
+					names[i], us / 1000);
+		else
+			len += snprintf(buf + len, size - len, " %s -",
+					names[i]);
+	}
+
+	return MIN(len, size - 1);
+}
+
+void tud_mount_cb(void)
+{
+	boot_mark(BOOT_USB_MOUNT, 0);
+}
+
+static void usb_backlog_put(struct usb_tx_state *tx, const char *ptr, int len)
+{
+	while (len--) {
+		if ((uint16_t)(tx->prod - tx->cons) == USB_BACKLOG_SIZE) {
+			tx->cons++;
+			tx->lost++;
+		}
+
+		tx->backlog[tx->prod++ % USB_BACKLOG_SIZE] = *ptr++;
+	}
+}
+
+static void usb_banner(int32_t port, struct usb_tx_state *tx)
+{
+	char *buf = tx->banner;
+	int size = sizeof(tx->banner), len;
+
+	len = snprintf(buf, size,
+		       "This is the Central Scrutinizer\n\r"
+		       "Control character is ^_\n\r"
+		       "Press ^_ + ? for help\n\r%s",
+		       clk_ok ? "" : "WARNING: Nominal frequency NOT reached\n\r");
+	if (tx->lost && len < size)
+		len += snprintf(buf + len, size - len,
+				"[%lu bytes of earlier output lost]\n\r",
+				tx->lost);
+	if (len < size)
+		len += boot_format(port, buf + len, size - len);
+	if (len < size)
+		len += snprintf(buf + len, size - len, "\n\r");
+
+	tx->banner_len = MIN(len, size - 1);
+	tx->banner_pos = 0;
+	tx->lost = 0;
+}
+
+/* Push as much of the banner and backlog as the CDC FIFO takes */
+static void usb_replay(int32_t port)
+{
+	struct usb_tx_state *tx = &usb_tx[port];
+
+	if (!tx->replay || !tud_cdc_n_connected(port))
+		return;
+
+	if (tx->replay == USB_REPLAY_BANNER) {
+		tx->banner_pos += tud_cdc_n_write(port, tx->banner + tx->banner_pos,
+						  tx->banner_len - tx->banner_pos);
+		if (tx->banner_pos < tx->banner_len)
+			return;
+
+		tx->replay = USB_REPLAY_BACKLOG;
+	}
+
+	while (tx->cons != tx->prod) {
+		uint16_t idx = tx->cons % USB_BACKLOG_SIZE;
+		uint16_t len = MIN((uint16_t)(tx->prod - tx->cons),
+				   USB_BACKLOG_SIZE - idx);
+		uint32_t sent;
+
+		sent = tud_cdc_n_write(port, &tx->backlog[idx], len);
+		if (!sent)
+			return;
+
+		tx->cons += sent;
+	}
+
+	tx->replay = USB_REPLAY_NONE;
+	tud_cdc_n_write_flush(port);
+}
+
+static int64_t usb_tx_timeout(alarm_id_t id, void *data)
+{
+	usb_tx[(uintptr_t)data].expired = true;
+	m1_pd_bmc_wake((uintptr_t)data, EVT_TIMER);
+	return 0;
+}
+
 static void usb_tx_bytes(int32_t port, const char *ptr, int len)
 {
-        if (!tud_cdc_n_connected(port))
+	/* Keep things in order until the backlog is out */
+	if (!tud_cdc_n_connected(port) || usb_tx[port].replay) {
+		usb_backlog_put(&usb_tx[port], ptr, len);
 		return;
+	}
 
 	while (len > 0) {
 		size_t available = tud_cdc_n_write_available(port);
 
 		if (!available) {
+			tud_cdc_n_write_flush(port);
 			tud_task();
 		} else {
 			size_t send = MIN(len, available);
@@ -275,60 +1147,402 @@ static void usb_tx_bytes(int32_t port, const char *ptr, int len)
 			ptr += sent;
 			len -= sent;
 		}
+	}
+
+	if (usb_tx[port].armed)
+		return;
+
+	usb_tx[port].armed = true;
+	if (add_alarm_in_us(USB_TX_LATENCY_US, usb_tx_timeout,
+			    (void *)(uintptr_t)port, true) < 0)
+		usb_tx[port].expired = true;
+}
+
+static void usb_flush(void)
+{
+	tud_task();
+
+	for (int i = 0; i < CFG_TUD_CDC; i++) {
+		usb_replay(i);
+
+		if (!usb_tx[i].expired)
+			continue;
+
+		usb_tx[i].expired = false;
+		usb_tx[i].armed = false;
+		tud_cdc_n_write_flush(i);
+	}
+}
+
+static int usb_rx_bytes(int32_t port, char *buf, int len)
+{
+	if (!tud_cdc_n_connected(port))
+		return 0;
+
+	return tud_cdc_n_read(port, buf, len);
+}
+
+void tud_cdc_rx_cb(uint8_t itf)
+{
+	m1_pd_bmc_wake(itf, EVT_HOST_RX);
+}
+
+static struct {
+	uint8_t		exit_on;
+	bool		dtr;
+	uint8_t		req;
+	volatile bool	pending;
+} upstream_raw[CONFIG_USB_PD_PORT_COUNT];
+
+/*
+ * Mostly called from TinyUSB callbacks, which mustn't end up back in
+ * tud_task(): only take note, the main loop does the rest.
+ */
+void upstream_set_raw(int32_t port, uint8_t exit_on)
+{
+	if (port >= CONFIG_USB_PD_PORT_COUNT)
+		return;
 
-		tud_cdc_n_write_flush(port);
-        }
+	upstream_raw[port].req = exit_on;
+	upstream_raw[port].pending = true;
+	m1_pd_bmc_wake(port, EVT_HOST_RX);
 }
 
-static int32_t usb_rx_byte(int32_t port)
+void upstream_apply_raw(int32_t port)
 {
-	uint8_t c;
+	uint8_t was_raw, exit_on;
+
+	if (!upstream_raw[port].pending)
+		return;
 
-	if (!tud_cdc_n_connected(port) || !tud_cdc_n_available(port))
-		return -1;
+	upstream_raw[port].pending = false;
+	exit_on = upstream_raw[port].req;
+	was_raw = upstream_raw[port].exit_on;
 
-	tud_cdc_n_read(port, &c, 1);
-	return c;
+	if (exit_on && !was_raw)
+		__printf(port, "P%ld: Raw mode on, exit with%s%s\n", port,
+			 (exit_on & RAW_EXIT_BREAK) ? " break" : "",
+			 (exit_on & RAW_EXIT_DTR) ? " DTR toggle" : "");
+
+	upstream_raw[port].dtr = tud_cdc_n_connected(port);
+	upstream_raw[port].exit_on = exit_on;
+
+	if (!exit_on && was_raw)
+		__printf(port, "P%ld: Raw mode off\n", port);
+}
+
+uint8_t upstream_get_raw(int32_t port)
+{
+	return upstream_raw[port].exit_on;
+}
+
+void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts)
+{
+	if (itf >= CONFIG_USB_PD_PORT_COUNT)
+		return;
+
+	/* Replayed from usb_flush(), not from within the USB stack */
+	if (dtr && !usb_tx[itf].open) {
+		boot_mark(BOOT_HOST_OPEN, itf);
+		if (!upstream_raw[itf].exit_on)
+			usb_banner(itf, &usb_tx[itf]);
+		else
+			usb_tx[itf].banner_len = usb_tx[itf].banner_pos = 0;
+		usb_tx[itf].replay = USB_REPLAY_BANNER;
+		m1_pd_bmc_wake(itf, EVT_HOST_RX);
+	}
+	usb_tx[itf].open = dtr;
+
+	if ((upstream_raw[itf].exit_on & RAW_EXIT_DTR) &&
+	    dtr != upstream_raw[itf].dtr)
+		upstream_set_raw(itf, 0);
 }
 
 static const struct upstream_ops usb_upstream_ops = {
 	.tx_bytes	= usb_tx_bytes,
-	.rx_byte	= usb_rx_byte,
-	.flush		= tud_task,
+	.rx_bytes	= usb_rx_bytes,
+	.flush		= usb_flush,
 };
 
+/*
+ * The serial upstream link runs UART1 with DMA both ways, on DMA_IRQ_0
+ * (the PIO UARTs have DMA_IRQ_1). RX is only ever given the free part
+ * of its ring, so a slow reader stalls the DMA rather than overwriting
+ * anything: the PL011 FIFO then fills up and either RTS goes away, or
+ * the FIFO overruns and we say so. TX never waits for the host, what
+ * doesn't fit in its ring is counted and reported once there's room.
+ */
+#define SERIAL1_RX_BITS		12
+#define SERIAL1_RX_SIZE		(1 << SERIAL1_RX_BITS)
+#define SERIAL1_TX_SIZE		4096
+#define SERIAL1_POLL_US		500
+
+#ifdef SERIAL_UPSTREAM_FLOW
+#define SERIAL1_FLOW		true
+#else
+#define SERIAL1_FLOW		false
+#endif
+
+static struct {
+	bool			ready;
+	bool			on;
+	int			rx_chan;
+	int			tx_chan;
+	/* The DMA has written up to rx_end - transfer_count */
+	volatile uint16_t	rx_end;
+	volatile uint16_t	rx_cons;
+	volatile bool		rx_stalled;
+	uint16_t		rx_seen;
+	volatile uint32_t	rx_overruns;
+	uint32_t		rx_reported;
+	volatile uint16_t	tx_prod;
+	volatile uint16_t	tx_cons;
+	volatile uint16_t	tx_len;		/* In flight */
+	uint32_t		tx_lost;
+	repeating_timer_t	timer;
+	char			tx_buf[SERIAL1_TX_SIZE];
+} serial1;
+
+/* The DMA wraps the writes around, hence the alignment */
+static char serial1_rx_buf[SERIAL1_RX_SIZE]
+	__attribute__((aligned(SERIAL1_RX_SIZE)));
+
+static uint16_t __not_in_flash_func(serial1_rx_prod)(void)
+{
+	uint16_t end;
+	uint32_t left;
+
+	/* The DMA interrupt may have moved the goalposts in between */
+	do {
+		end = serial1.rx_end;
+		left = dma_channel_hw_addr(serial1.rx_chan)->transfer_count;
+	} while (end != serial1.rx_end);
+
+	return end - left;
+}
+
+/* Let the RX DMA loose on the free part of the ring, once it's idle */
+static void __not_in_flash_func(serial1_rx_arm)(void)
+{
+	uint16_t prod = serial1.rx_end;
+	uint16_t room = SERIAL1_RX_SIZE - (uint16_t)(prod - serial1.rx_cons);
+
+	serial1.rx_stalled = !room;
+	if (!room)
+		return;
+
+	serial1.rx_end = prod + room;
+	dma_channel_set_write_addr(serial1.rx_chan,
+				   &serial1_rx_buf[prod % SERIAL1_RX_SIZE],
+				   false);
+	dma_channel_set_trans_count(serial1.rx_chan, room, true);
+}
+
+/* Start on the next contiguous chunk of the TX ring, if idle */
+static void __not_in_flash_func(serial1_tx_kick)(void)
+{
+	uint16_t idx, len;
+
+	if (serial1.tx_len || serial1.tx_prod == serial1.tx_cons)
+		return;
+
+	idx = serial1.tx_cons % SERIAL1_TX_SIZE;
+	len = MIN((uint16_t)(serial1.tx_prod - serial1.tx_cons),
+		  SERIAL1_TX_SIZE - idx);
+	serial1.tx_len = len;
+	dma_channel_transfer_from_buffer_now(serial1.tx_chan,
+					     &serial1.tx_buf[idx], len);
+}
+
+static void __not_in_flash_func(serial1_dma_irq)(void)
+{
+	if (dma_channel_get_irq0_status(serial1.tx_chan)) {
+		dma_channel_acknowledge_irq0(serial1.tx_chan);
+		serial1.tx_cons += serial1.tx_len;
+		serial1.tx_len = 0;
+		serial1_tx_kick();
+	}
+
+	if (dma_channel_get_irq0_status(serial1.rx_chan)) {
+		dma_channel_acknowledge_irq0(serial1.rx_chan);
+		serial1_rx_arm();
+		m1_pd_bmc_wake(0, EVT_HOST_RX);
+	}
+}
+
+/* Nothing interrupts on RX: follow the DMA, and look for overruns */
+static bool __not_in_flash_func(serial1_poll)(repeating_timer_t *t)
+{
+	uart_hw_t *hw = uart_get_hw(uart1);
+	uint16_t prod = serial1_rx_prod();
+
+	if (hw->rsr & UART_UARTRSR_OE_BITS) {
+		hw->rsr = UART_UARTRSR_OE_BITS;
+		serial1.rx_overruns++;
+		m1_pd_bmc_wake(0, EVT_HOST_RX);
+	}
+
+	if (prod != serial1.rx_seen) {
+		serial1.rx_seen = prod;
+		m1_pd_bmc_wake(0, EVT_HOST_RX);
+	}
+
+	return true;
+}
+
+static void serial1_start(void)
+{
+	dma_channel_config c;
+
+	if (serial1.on)
+		return;
+
+	/* The DMA drains the FIFOs from now on */
+	uart_set_irq_enables(uart1, false, false);
+	uart_set_hw_flow(uart1, SERIAL1_FLOW, SERIAL1_FLOW);
+
+	if (!serial1.ready) {
+		serial1.rx_chan = dma_claim_unused_channel(true);
+		c = dma_channel_get_default_config(serial1.rx_chan);
+		channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+		channel_config_set_read_increment(&c, false);
+		channel_config_set_write_increment(&c, true);
+		channel_config_set_ring(&c, true, SERIAL1_RX_BITS);
+		channel_config_set_dreq(&c, uart_get_dreq(uart1, false));
+		dma_channel_configure(serial1.rx_chan, &c, serial1_rx_buf,
+				      &uart_get_hw(uart1)->dr, 0, false);
+
+		serial1.tx_chan = dma_claim_unused_channel(true);
+		c = dma_channel_get_default_config(serial1.tx_chan);
+		channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+		channel_config_set_read_increment(&c, true);
+		channel_config_set_write_increment(&c, false);
+		channel_config_set_dreq(&c, uart_get_dreq(uart1, true));
+		dma_channel_configure(serial1.tx_chan, &c,
+				      &uart_get_hw(uart1)->dr, NULL, 0, false);
+
+		irq_set_exclusive_handler(DMA_IRQ_0, serial1_dma_irq);
+		serial1.ready = true;
+	}
+
+	serial1.rx_end = serial1.rx_cons = serial1.rx_seen = 0;
+	serial1.tx_prod = serial1.tx_cons = serial1.tx_len = 0;
+	serial1.on = true;
+
+	dma_channel_acknowledge_irq0(serial1.rx_chan);
+	dma_channel_acknowledge_irq0(serial1.tx_chan);
+	dma_channel_set_irq0_enabled(serial1.rx_chan, true);
+	dma_channel_set_irq0_enabled(serial1.tx_chan, true);
+	serial1_rx_arm();
+	irq_set_enabled(DMA_IRQ_0, true);
+
+	add_repeating_timer_us(-SERIAL1_POLL_US, serial1_poll, NULL,
+			       &serial1.timer);
+}
+
+/* Back to interrupts, the way port 1 had UART1 set up */
+static void serial1_stop(void)
+{
+	const struct hw_context *hw = &port_hw[1];
+
+	if (!serial1.on)
+		return;
+
+	cancel_repeating_timer(&serial1.timer);
+	irq_set_enabled(DMA_IRQ_0, false);
+	dma_channel_set_irq0_enabled(serial1.rx_chan, false);
+	dma_channel_set_irq0_enabled(serial1.tx_chan, false);
+	dma_channel_abort(serial1.rx_chan);
+	dma_channel_abort(serial1.tx_chan);
+	serial1.on = false;
+
+	uart_set_hw_flow(uart1,
+			 !hw->pins[UART_CTS].skip, !hw->pins[UART_RTS].skip);
+	uart_set_irq_enables(uart1, true, false);
+}
+
+/* Whatever fits, the rest is lost */
+static int serial1_tx_put(const char *ptr, int len)
+{
+	uint16_t room;
+
+	room = SERIAL1_TX_SIZE - (uint16_t)(serial1.tx_prod - serial1.tx_cons);
+	len = MIN(len, room);
+	for (int i = 0; i < len; i++)
+		serial1.tx_buf[(uint16_t)(serial1.tx_prod + i) % SERIAL1_TX_SIZE] = ptr[i];
+	serial1.tx_prod += len;
+
+	return len;
+}
+
+/* Only port 0 goes over the serial link, the others stay on USB */
 static void serial1_tx_bytes(int32_t port, const char *ptr, int len)
 {
-	uart_write_blocking(uart1, (const uint8_t *)ptr, len);
+	int sent;
+
+	if (port) {
+		usb_tx_bytes(port, ptr, len);
+		return;
+	}
+
+	/* The host stopped reading for a while, let it know */
+	if (serial1.tx_lost) {
+		char note[40];
+		int n;
+
+		n = snprintf(note, sizeof(note), "[%lu bytes of output lost]\n\r",
+			     serial1.tx_lost);
+		if (SERIAL1_TX_SIZE - (uint16_t)(serial1.tx_prod - serial1.tx_cons) >= n) {
+			serial1_tx_put(note, n);
+			serial1.tx_lost = 0;
+		}
+	}
+
+	sent = serial1.tx_lost ? 0 : serial1_tx_put(ptr, len);
+	serial1.tx_lost += len - sent;
+
+	irq_set_enabled(DMA_IRQ_0, false);
+	serial1_tx_kick();
+	irq_set_enabled(DMA_IRQ_0, true);
 }
 
-static int32_t serial1_rx_byte(int32_t port)
+static int serial1_rx_bytes(int32_t port, char *buf, int len)
 {
-	uint32_t status;
-	int32_t val;
+	uint16_t prod;
+	int val;
 
-	tud_task();
-	val = usb_rx_byte(port);
-	if (val != -1)
+	val = usb_rx_bytes(port, buf, len);
+	if (val || port)
 		return val;
 
-	status = save_and_disable_interrupts();
+	if (serial1.rx_overruns != serial1.rx_reported) {
+		serial1.rx_reported = serial1.rx_overruns;
+		__printf(0, "P0: Serial link overrun, input lost (%lu so far)\n",
+			 serial1.rx_reported);
+	}
 
-	if (uart1_buf.prod == uart1_buf.cons)
-		val = -1;
-	else
-		val = uart1_buf.buf[uart1_buf.cons++];
+	prod = serial1_rx_prod();
+	while (val < len && serial1.rx_cons != prod)
+		buf[val++] = serial1_rx_buf[serial1.rx_cons++ % SERIAL1_RX_SIZE];
 
-	restore_interrupts(status);
+	/* There's room again, the DMA can carry on */
+	if (serial1.rx_stalled) {
+		irq_set_enabled(DMA_IRQ_0, false);
+		serial1_rx_arm();
+		irq_set_enabled(DMA_IRQ_0, true);
+	}
 
 	return val;
 }
 
-static void serial1_flush(void) {}
+static void serial1_flush(void)
+{
+	usb_flush();
+}
 
 static const struct upstream_ops serial1_upstream_ops = {
 	.tx_bytes	= serial1_tx_bytes,
-	.rx_byte	= serial1_rx_byte,
+	.rx_bytes	= serial1_rx_bytes,
 	.flush		= serial1_flush,
 };
 
@@ -336,11 +1550,12 @@ const struct upstream_ops *upstream_ops;
 
 void upstream_tx_str(int32_t port, const char *str)
 {
-	do {
-		const char *cursor = str;
+	/* Don't corrupt the binary stream */
+	if (upstream_raw[port].exit_on)
+		return;
 
-		while (*cursor && *cursor != '\n')
-			cursor++;
+	do {
+		const char *cursor = swar_find_eol(str);
 
 		upstream_ops->tx_bytes(port, str, cursor - str);
 
@@ -356,9 +1571,11 @@ void upstream_tx_str(int32_t port, const char *str)
 void set_upstream_ops(bool serial)
 {
 	if (serial) {
+		serial1_start();
 		upstream_ops = &serial1_upstream_ops;
 	} else {
 		upstream_ops = &usb_upstream_ops;
+		serial1_stop();
 	}
 
 	__dsb();
@@ -369,57 +1586,47 @@ bool upstream_is_serial(void)
 	return upstream_ops == &serial1_upstream_ops;
 }
 
-static int wait_for_usb_connection(void)
-{
-	do {
-		static bool state = false;
-		static int cnt = 0;
-
-		tud_task();
-		gpio_put(hw0.pins[LED_G].pin, state);
-		sleep_ms(1);
-		cnt++;
-		cnt %= 256;
-		if (!cnt)
-			state = !state;
-	} while (!tud_cdc_n_connected(0) && !tud_cdc_n_connected(1));
-
-	return !tud_cdc_n_connected(0);
-}
-
+/*
+ * Nothing waits for the host: PD and the serial capture start right
+ * away, and opening a port later replays the banner and the backlog.
+ */
 int main(void)
 {
-	bool success;
-	int port;
+	bool warm[CONFIG_USB_PD_PORT_COUNT];
+
+	/* As early as possible, so that VBUS doesn't go away for long */
+	for (int i = 0; i < CONFIG_USB_PD_PORT_COUNT; i++)
+		warm[i] = m1_pd_bmc_warm_early(i, &port_hw[i]);
 
 	set_upstream_ops(false);
 
-	success = set_sys_clock_khz(133000, false);
+	clk_ok = set_sys_clock_khz(133000, false);
 
 	board_init();
 	tusb_init();
 
-	m1_pd_bmc_system_init(&hw0);
-	m1_pd_bmc_system_init(&hw1);
+	for (int i = 0; i < CONFIG_USB_PD_PORT_COUNT; i++)
+		m1_pd_bmc_system_init(i, &port_hw[i], warm[i]);
 
 	if (apply_waveshare_2ch_rs232_overrides()) {
 		set_upstream_ops(true);
-		port = 0;
-		__printf(port, "Detected Waveshare 2CH RS232, switching UART1\n");
-	} else {
-		port = wait_for_usb_connection();
-	}
+		__printf(0, "Detected Waveshare 2CH RS232, switching UART1\n");
+		__printf(0, "This is the Central Scrutinizer\n");
+		__printf(0, "Control character is ^_\n");
+		__printf(0, "Press ^_ + ? for help\n");
 
-	__printf(port, "This is the Central Scrutinizer\n");
-	__printf(port, "Control character is ^_\n");
-	__printf(port, "Press ^_ + ? for help\n");
+		if (!clk_ok)
+			__printf(0, "WARNING: Nominal frequency NOT reached\n");
 
-	if (!success)
-		__printf(port, "WARNING: Nominal frequency NOT reached\n");
+		/* UART1 now talks to the host, port 1 carries on with PIO */
+		m1_pd_bmc_system_init(1, &port1_pio_hw, warm[1]);
+	}
 
-	m1_pd_bmc_fusb_setup(0, &hw0);
-	if (!upstream_is_serial()) {
-		m1_pd_bmc_fusb_setup(1, &hw1);
+	for (int i = 0; i < CONFIG_USB_PD_PORT_COUNT; i++) {
+		if (i == 1 && upstream_is_serial())
+			m1_pd_bmc_fusb_setup(i, &port1_pio_hw);
+		else
+			m1_pd_bmc_fusb_setup(i, &port_hw[i]);
 	}
 
 	m1_pd_bmc_run();
@@ -0,0 +1,63 @@
+// Word-at-a-time scanning helpers for the serial data paths
+
+#ifndef SWAR_H
+#define SWAR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t __attribute__((__may_alias__)) swar_word_t;
+
+#define SWAR_ONES	0x01010101U
+#define SWAR_HIGHS	0x80808080U
+
+/* Non-zero if any byte of v is zero */
+#define swar_has_zero(v)	(((v) - SWAR_ONES) & ~(v) & SWAR_HIGHS)
+
+/* Offset of the first c in buf, or len if there is none */
+static inline size_t swar_find_byte(const char *buf, size_t len, char c)
+{
+	const char *p = buf, *end = buf + len;
+	const uint32_t pat = (uint8_t)c * SWAR_ONES;
+
+	for (; p < end && ((uintptr_t)p & 3); p++)
+		if (*p == c)
+			return p - buf;
+
+	for (; end - p >= 4; p += 4)
+		if (swar_has_zero(*(const swar_word_t *)p ^ pat))
+			break;
+
+	for (; p < end; p++)
+		if (*p == c)
+			break;
+
+	return p - buf;
+}
+
+/*
+ * First '\n' or terminating NUL in str. Aligned word reads never
+ * cross into memory past the word holding the NUL.
+ */
+static inline const char *swar_find_eol(const char *str)
+{
+	const uint32_t pat = '\n' * SWAR_ONES;
+
+	for (; (uintptr_t)str & 3; str++)
+		if (!*str || *str == '\n')
+			return str;
+
+	for (;; str += 4) {
+		uint32_t v = *(const swar_word_t *)str;
+
+		if (swar_has_zero(v) || swar_has_zero(v ^ pat))
+			break;
+	}
+
+	while (*str && *str != '\n')
+		str++;
+
+	return str;
+}
+
+#endif
@@ -14,6 +14,7 @@ extern "C" {
 
 #include "tcpm_driver.h"
 #include "usb_pd_tcpm.h"
+#include "FUSB302.h"
 
 #if defined(CONFIG_USB_PD_DUAL_ROLE_AUTO_TOGGLE) && \
 	!defined(CONFIG_USB_PD_DUAL_ROLE)
@@ -21,6 +22,37 @@ extern "C" {
 #error "Please upgrade your board configuration"
 #endif
 
+/*
+ * What the PD state machine needs from a port controller. The FUSB302
+ * does it all over I2C, other PHYs can borrow its analog side.
+ */
+struct tcpm_drv {
+	int16_t (*init)(int16_t port);
+	void (*pd_reset)(int16_t port);
+	int16_t (*get_cc)(int16_t port, int16_t *cc1, int16_t *cc2);
+	int16_t (*get_vbus_level)(int16_t port);
+	int16_t (*select_rp_value)(int16_t port, int16_t rp);
+	int16_t (*set_cc)(int16_t port, int16_t pull);
+	int16_t (*set_polarity)(int16_t port, int16_t polarity);
+	int16_t (*set_vconn)(int16_t port, int16_t enable);
+	int16_t (*set_msg_header)(int16_t port, int16_t power_role,
+				  int16_t data_role);
+	int16_t (*set_rx_enable)(int16_t port, int16_t enable);
+	/* NULL if nothing came in, pd_msg_put() it once done */
+	struct pd_msg *(*get_message)(int16_t port);
+	int16_t (*transmit)(int16_t port, enum tcpm_transmit_type type,
+			    uint16_t header, const uint32_t *data);
+	void (*get_irq)(int16_t port, int16_t *irq, int16_t *irqa,
+			int16_t *irqb);
+	int16_t (*rx_fifo_is_empty)(int16_t port);
+	/* Last message sent, MessageID included. 0xff retries if unknown */
+	void (*get_tx_status)(int16_t port, uint16_t *header,
+			      uint8_t *retries);
+};
+
+/* BMC on PIO1, with the FUSB302 left to deal with CC and VBUS */
+extern const struct tcpm_drv pd_pio_tcpm_drv;
+
 #ifndef CONFIG_USB_PD_TCPC
 extern const struct tcpc_config_t tcpc_config[];
 
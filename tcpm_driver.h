@@ -18,7 +18,9 @@ extern "C" {
 // USB-C Stuff
 #include "tcpm.h"
 #include "FUSB302.h"
+#ifndef CONFIG_USB_PD_PORT_COUNT
 #define CONFIG_USB_PD_PORT_COUNT 2
+#endif
 extern struct i2c_master_module i2c_master_instance;
 
 #ifdef __cplusplus
@@ -0,0 +1,219 @@
+// Host test for the USB-PD PHY coding in pd_phy.c
+//
+//  cc -Wall -I. -o pd_phy_test tools/pd_phy_test.c pd_phy.c
+//  ./pd_phy_test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pd_phy.h"
+
+#define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
+
+static int failures;
+
+#define check(cond, ...)					\
+	do {							\
+		if (!(cond)) {					\
+			printf("FAIL %s:%d: ", __FILE__, __LINE__);	\
+			printf(__VA_ARGS__);			\
+			printf("\n");				\
+			failures++;				\
+		}						\
+	} while (0)
+
+static const enum pd_phy_sop sops[] = {
+	PD_PHY_SOP, PD_PHY_SOP1, PD_PHY_SOP2,
+	PD_PHY_SOP1_DEBUG, PD_PHY_SOP2_DEBUG,
+	PD_PHY_HARD_RESET, PD_PHY_CABLE_RESET,
+};
+
+static bool is_reset(enum pd_phy_sop sop)
+{
+	return sop == PD_PHY_HARD_RESET || sop == PD_PHY_CABLE_RESET;
+}
+
+static int tx_half(const struct pd_phy_tx *tx, int i)
+{
+	return (tx->buf[i / 32] >> (i % 32)) & 1;
+}
+
+/*
+ * Do what the PIO does: recover the bits from the half-UI levels, a
+ * one being a mid-bit transition. Also check that every bit starts
+ * with an edge, and that the line is left low.
+ */
+static int tx_to_bits(const struct pd_phy_tx *tx, uint8_t *bits, int max)
+{
+	int prev = 0, nr = 0;
+
+	check(!(tx->halfbits & 1), "odd number of half-bits %d", tx->halfbits);
+	check(!tx_half(tx, tx->halfbits - 1), "line left high");
+
+	for (int i = 0; i + 1 < tx->halfbits - 2 && nr < max; i += 2) {
+		int a = tx_half(tx, i), b = tx_half(tx, i + 1);
+
+		check(a != prev, "no edge at the start of bit %d", nr);
+		bits[nr++] = a != b;
+		prev = b;
+	}
+
+	return nr;
+}
+
+static enum pd_phy_rx_status feed(struct pd_phy_rx *rx, const uint8_t *bits,
+				  int nr)
+{
+	enum pd_phy_rx_status st = PD_PHY_RX_MORE;
+
+	pd_phy_rx_reset(rx);
+	for (int i = 0; i < nr && st == PD_PHY_RX_MORE; i++)
+		st = pd_phy_rx_bit(rx, bits[i]);
+
+	return st;
+}
+
+static void test_round_trip(void)
+{
+	static uint8_t bits[PD_PHY_MAX_HALFBITS / 2];
+	struct pd_phy_tx tx;
+	struct pd_phy_rx rx;
+
+	srand(1);
+
+	for (int s = 0; s < ARRAY_SIZE(sops); s++) {
+		for (int cnt = 0; cnt < 8; cnt++) {
+			uint32_t data[7], payload[7];
+			uint16_t header;
+			int nr, len;
+
+			header = (cnt << 12) | (rand() & 0x8fff);
+			for (int i = 0; i < 7; i++)
+				data[i] = ((uint32_t)rand() << 16) ^ rand();
+
+			check(pd_phy_encode(&tx, sops[s], header, data),
+			      "encode sop %02x cnt %d", sops[s], cnt);
+			check(tx.halfbits <= PD_PHY_MAX_HALFBITS,
+			      "%d half-bits", tx.halfbits);
+
+			nr = tx_to_bits(&tx, bits, ARRAY_SIZE(bits));
+			check(feed(&rx, bits, nr) == PD_PHY_RX_DONE,
+			      "decode sop %02x cnt %d", sops[s], cnt);
+			check(rx.sop == sops[s], "sop %02x != %02x",
+			      rx.sop, sops[s]);
+
+			/* Resets have no payload, and one is enough */
+			if (is_reset(sops[s]))
+				break;
+
+			check(pd_phy_rx_header(&rx) == header,
+			      "header %04x != %04x", pd_phy_rx_header(&rx), header);
+			len = pd_phy_rx_payload(&rx, payload);
+			check(len == cnt * 4, "payload %d bytes, not %d", len, cnt * 4);
+			check(!memcmp(payload, data, cnt * 4),
+			      "payload mismatch sop %02x cnt %d", sops[s], cnt);
+
+			/* A flipped bit in the CRC must be caught */
+			bits[nr - 10] ^= 1;
+			check(feed(&rx, bits, nr) == PD_PHY_RX_ERROR,
+			      "corruption missed sop %02x cnt %d", sops[s], cnt);
+		}
+	}
+
+	check(!pd_phy_encode(&tx, 0x42, 0, NULL), "bogus SOP encoded");
+}
+
+/*
+ * Reference messages, as 5-bit symbols after the preamble (SOP, header,
+ * data objects, CRC and EOP), the CRCs worked out independently with
+ * zlib's crc32().
+ */
+static const struct {
+	const char	*name;
+	uint16_t	header;
+	uint32_t	data[7];
+	uint8_t		nsyms;
+	uint8_t		syms[4 + 2 * PD_PHY_MAX_BYTES + 1];
+} refs[] = {
+	{
+		/* GoodCRC, MessageID 0, PD 2.0, Source/DFP */
+		.name	= "GoodCRC",
+		.header	= 0x0161,
+		.nsyms	= 17,
+		.syms	= {
+			0x18, 0x18, 0x18, 0x11,			/* SOP */
+			0x09, 0x0e, 0x09, 0x1e,			/* 0x0161 */
+			0x1d, 0x12, 0x12, 0x0f,			/* CRC */
+			0x12, 0x15, 0x16, 0x0a,
+			0x0d,					/* EOP */
+		},
+	},
+	{
+		/* Source_Capabilities, one fixed PDO: 5V 3A */
+		.name	= "Source_Capabilities",
+		.header	= 0x1161,
+		.data	= { 0x0801912c },
+		.nsyms	= 25,
+		.syms	= {
+			0x18, 0x18, 0x18, 0x11,			/* SOP */
+			0x09, 0x0e, 0x09, 0x09,			/* 0x1161 */
+			0x1a, 0x14, 0x09, 0x13,			/* 0x0801912c */
+			0x09, 0x1e, 0x12, 0x1e,
+			0x1a, 0x0b, 0x12, 0x17,			/* CRC */
+			0x1d, 0x09, 0x1c, 0x14,
+			0x0d,					/* EOP */
+		},
+	},
+};
+
+static void test_reference(void)
+{
+	static uint8_t bits[PD_PHY_MAX_HALFBITS / 2];
+	static uint8_t ref[PD_PHY_MAX_HALFBITS / 2];
+
+	for (int m = 0; m < ARRAY_SIZE(refs); m++) {
+		int cnt = (refs[m].header >> 12) & 7;
+		struct pd_phy_tx tx;
+		struct pd_phy_rx rx;
+		uint32_t payload[7];
+		int nr = 0, len;
+
+		for (int i = 0; i < PD_PHY_PREAMBLE_BITS; i++)
+			ref[nr++] = i & 1;
+		for (int i = 0; i < refs[m].nsyms; i++)
+			for (int j = 0; j < 5; j++)
+				ref[nr++] = (refs[m].syms[i] >> j) & 1;
+
+		/* The decoder must take it... */
+		check(feed(&rx, ref, nr) == PD_PHY_RX_DONE, "%s: decode", refs[m].name);
+		check(rx.sop == PD_PHY_SOP, "%s: sop %02x", refs[m].name, rx.sop);
+		check(pd_phy_rx_header(&rx) == refs[m].header, "%s: header %04x",
+		      refs[m].name, pd_phy_rx_header(&rx));
+		len = pd_phy_rx_payload(&rx, payload);
+		check(len == cnt * 4 && !memcmp(payload, refs[m].data, len),
+		      "%s: payload", refs[m].name);
+
+		/* ... and the encoder must produce it bit for bit */
+		check(pd_phy_encode(&tx, PD_PHY_SOP, refs[m].header, refs[m].data),
+		      "%s: encode", refs[m].name);
+		check(tx_to_bits(&tx, bits, ARRAY_SIZE(bits)) == nr &&
+		      !memcmp(bits, ref, nr), "%s: encoder output", refs[m].name);
+	}
+}
+
+static void test_crc(void)
+{
+	check(pd_crc32((const uint8_t *)"123456789", 9) == 0xcbf43926,
+	      "CRC32 check value");
+}
+
+int main(void)
+{
+	test_crc();
+	test_round_trip();
+	test_reference();
+
+	printf("%s\n", failures ? "FAILED" : "OK");
+	return !!failures;
+}
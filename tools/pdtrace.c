@@ -0,0 +1,180 @@
+// Capture the USB-PD trace of the Central Scrutinizer as pcap
+//
+//  cc -o pdtrace tools/pdtrace.c $(pkg-config --cflags --libs libusb-1.0)
+//  ./pdtrace 0 1 > pd.pcap
+//  ./pdtrace 0 | wireshark -k -i -
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <libusb.h>
+
+#define CS_VID			0x2e8a
+#define CS_PID			0x000a
+
+/* See enum cs_vendor_request */
+#define CS_REQ_TIMEBASE		3
+#define CS_REQ_TRACE		4
+#define CS_REQ_TRACE_READ	5
+
+#define REQ_OUT			0x40
+#define REQ_IN			0xc0
+
+/* See struct pdtrace_rec */
+#define REC_HDR			16
+#define REC_MAX			(REC_HDR + 7 * 4)
+
+#define LINKTYPE_USER0		147
+#define POLL_US			5000
+
+static volatile sig_atomic_t done;
+
+static void stop(int sig)
+{
+	done = 1;
+}
+
+static void pcap_header(FILE *f)
+{
+	struct {
+		uint32_t	magic;
+		uint16_t	major;
+		uint16_t	minor;
+		int32_t		thiszone;
+		uint32_t	sigfigs;
+		uint32_t	snaplen;
+		uint32_t	network;
+	} h = {
+		.magic		= 0xa1b2c3d4,	/* Microsecond timestamps */
+		.major		= 2,
+		.minor		= 4,
+		.snaplen	= REC_MAX,
+		.network	= LINKTYPE_USER0,
+	};
+
+	fwrite(&h, sizeof(h), 1, f);
+}
+
+/* One pcap packet per record, with the record as it came */
+static void pcap_record(FILE *f, const uint8_t *rec)
+{
+	struct {
+		uint32_t	sec;
+		uint32_t	usec;
+		uint32_t	incl_len;
+		uint32_t	orig_len;
+	} h;
+	uint64_t us = 0;
+
+	for (int i = 7; i >= 0; i--)
+		us = (us << 8) | rec[8 + i];
+
+	h.sec = us / 1000000;
+	h.usec = us % 1000000;
+	h.incl_len = h.orig_len = rec[0];
+
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(rec, rec[0], 1, f);
+}
+
+static int set_timebase(libusb_device_handle *h)
+{
+	struct timeval tv;
+	uint8_t buf[8];
+	uint64_t us;
+
+	gettimeofday(&tv, NULL);
+	us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	for (int i = 0; i < 8; i++)
+		buf[i] = us >> (8 * i);
+
+	return libusb_control_transfer(h, REQ_OUT, CS_REQ_TIMEBASE, 0, 0,
+				       buf, sizeof(buf), 1000);
+}
+
+static void trace_ports(libusb_device_handle *h, int argc, char **argv,
+			int on)
+{
+	for (int i = 1; i < argc; i++)
+		libusb_control_transfer(h, REQ_OUT, CS_REQ_TRACE, on,
+					atoi(argv[i]), NULL, 0, 1000);
+}
+
+int main(int argc, char **argv)
+{
+	libusb_device_handle *h;
+	uint8_t buf[1024];
+	int ret = 1;
+
+	if (argc < 2 || isatty(fileno(stdout))) {
+		fprintf(stderr, "Usage: %s <port>... > file.pcap\n", argv[0]);
+		return 1;
+	}
+
+	if (libusb_init(NULL))
+		return 1;
+
+	h = libusb_open_device_with_vid_pid(NULL, CS_VID, CS_PID);
+	if (!h) {
+		fprintf(stderr, "No Central Scrutinizer found\n");
+		goto out;
+	}
+
+	/* Records are then stamped with our own idea of the time */
+	if (set_timebase(h) < 0) {
+		fprintf(stderr, "Can't set the timebase\n");
+		goto close;
+	}
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	signal(SIGPIPE, stop);
+
+	pcap_header(stdout);
+	trace_ports(h, argc, argv, 1);
+
+	while (!done) {
+		int len, pos = 0;
+
+		len = libusb_control_transfer(h, REQ_IN, CS_REQ_TRACE_READ, 0, 0,
+					      buf, sizeof(buf), 1000);
+		if (len < 0) {
+			fprintf(stderr, "%s\n", libusb_error_name(len));
+			break;
+		}
+
+		while (pos < len) {
+			uint8_t rl = buf[pos];
+
+			if (rl < REC_HDR || rl > REC_MAX || pos + rl > len) {
+				fprintf(stderr, "Bad record, giving up\n");
+				done = 1;
+				break;
+			}
+
+			if (buf[pos + 2] & 2)	/* PDTRACE_F_LOST */
+				fprintf(stderr, "%d records lost\n",
+					buf[pos + 6] | (buf[pos + 7] << 8));
+
+			pcap_record(stdout, buf + pos);
+			pos += rl;
+		}
+
+		fflush(stdout);
+		if (!len)
+			usleep(POLL_US);
+	}
+
+	trace_ports(h, argc, argv, 0);
+	ret = 0;
+close:
+	libusb_close(h);
+out:
+	libusb_exit(NULL);
+	return ret;
+}
@@ -0,0 +1,150 @@
+// Compare the swar.h scanners with the byte loops they replaced
+//
+//  cc -O2 -Wall -I. -o swar_bench tools/swar_bench.c
+//  ./swar_bench
+//
+// This runs on the host, whose numbers only hint at the Cortex-M0+
+// ones: the M0+ has no cache and no branch predictor to speak of, and
+// a word load costs the same as a byte load there.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "swar.h"
+
+#define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
+
+#define BUF_SIZE	4096
+#define ROUNDS		20000
+
+/* What serial_handler() and upstream_tx_str() used to do */
+static size_t byte_find_byte(const char *buf, size_t len, char c)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (buf[i] == c)
+			break;
+
+	return i;
+}
+
+static const char *byte_find_eol(const char *str)
+{
+	while (*str && *str != '\n')
+		str++;
+
+	return str;
+}
+
+static volatile size_t sink;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Console-like text, with a newline every @line bytes on average */
+static void fill(char *buf, size_t len, int line)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = (rand() % line) ? ' ' + rand() % 95 : '\n';
+	buf[len - 1] = 0;
+}
+
+static double bench_byte(size_t (*fn)(const char *, size_t, char),
+			 const char *buf, size_t len)
+{
+	double t = now_ns();
+
+	for (int r = 0; r < ROUNDS; r++)
+		for (size_t off = 0; off < len; off++)
+			off += fn(buf + off, len - off, 0x1f);
+
+	return (now_ns() - t) / ROUNDS / len;
+}
+
+static double bench_eol(const char *(*fn)(const char *), const char *buf)
+{
+	double t = now_ns();
+
+	for (int r = 0; r < ROUNDS; r++) {
+		const char *p = buf;
+
+		while (*(p = fn(p)))
+			p++;
+		sink += p - buf;
+	}
+
+	return (now_ns() - t) / ROUNDS / strlen(buf);
+}
+
+int main(void)
+{
+	static const int lines[] = { 8, 40, 200, BUF_SIZE };
+	static char buf[BUF_SIZE + 3];
+	int failures = 0;
+
+	srand(1);
+
+	/* Same answers at every alignment and length first */
+	for (int misalign = 0; misalign < 4; misalign++) {
+		char *b = buf + misalign;
+
+		fill(b, BUF_SIZE, 40);
+		for (size_t len = 0; len < 64; len++) {
+			for (size_t pos = 0; pos <= len; pos++) {
+				char save = pos < len ? b[pos] : 0;
+
+				if (pos < len)
+					b[pos] = 0x1f;
+				if (swar_find_byte(b, len, 0x1f) !=
+				    byte_find_byte(b, len, 0x1f))
+					failures++;
+				if (pos < len)
+					b[pos] = save;
+			}
+		}
+
+		for (const char *p = b; *p; p++)
+			if (swar_find_eol(p) != byte_find_eol(p))
+				failures++;
+	}
+
+	if (failures) {
+		printf("%d mismatches\n", failures);
+		return 1;
+	}
+
+	printf("%-24s %10s %10s\n", "ns/byte", "byte loop", "swar");
+
+	/* Host input, where ^_ is rare */
+	fill(buf, BUF_SIZE, 40);
+	for (int i = 0; i < 3; i++) {
+		size_t len = (size_t[]){ 16, 256, BUF_SIZE }[i];
+		char name[32];
+
+		snprintf(name, sizeof(name), "find_byte, %zu bytes", len);
+		printf("%-24s %10.3f %10.3f\n", name,
+		       bench_byte(byte_find_byte, buf, len),
+		       bench_byte(swar_find_byte, buf, len));
+	}
+
+	/* Console output, with lines of various lengths */
+	for (int i = 0; i < ARRAY_SIZE(lines); i++) {
+		char name[32];
+
+		fill(buf, BUF_SIZE, lines[i]);
+		snprintf(name, sizeof(name), "find_eol, ~%d/line", lines[i]);
+		printf("%-24s %10.3f %10.3f\n", name,
+		       bench_eol(byte_find_eol, buf),
+		       bench_eol(swar_find_eol, buf));
+	}
+
+	return 0;
+}
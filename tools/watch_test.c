@@ -0,0 +1,201 @@
+// Host test for the console pattern matcher in watch.c
+//
+//  cc -Wall -I. -o watch_test tools/watch_test.c watch.c
+//  ./watch_test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "watch.h"
+
+static int failures;
+
+#define check(cond, ...)					\
+	do {							\
+		if (!(cond)) {					\
+			printf("FAIL %s:%d: ", __FILE__, __LINE__);	\
+			printf(__VA_ARGS__);			\
+			printf("\n");				\
+			failures++;				\
+		}						\
+	} while (0)
+
+/* What matched, in order, as pattern indices */
+struct log {
+	struct watch	*w;
+	char		hits[64];
+	int		nr;
+	int		del;		/* Delete this one when it hits */
+	int		add;		/* Add a pattern when this one hits */
+};
+
+static void log_match(void *data, int idx)
+{
+	struct log *l = data;
+
+	if (l->nr < sizeof(l->hits) - 1)
+		l->hits[l->nr++] = '0' + idx;
+	l->hits[l->nr] = 0;
+
+	if (idx == l->del)
+		watch_del(l->w, idx);
+	if (idx == l->add)
+		check(watch_add(l->w, "zz", 2) >= 0, "add from a callback");
+}
+
+static void log_init(struct log *l, struct watch *w)
+{
+	memset(l, 0, sizeof(*l));
+	l->w = w;
+	l->del = -1;
+	l->add = -1;
+}
+
+static void feed(struct watch *w, struct log *l, const char *str)
+{
+	watch_feed(w, str, strlen(str), log_match, l);
+}
+
+static struct watch *watch_new(void)
+{
+	struct watch *w = calloc(1, sizeof(*w));
+
+	/* An empty trie still has its root */
+	watch_del(w, 0);
+	return w;
+}
+
+/* The textbook set, where patterns end inside each other */
+static void test_overlap(void)
+{
+	struct watch *w = watch_new();
+	struct log l;
+
+	log_init(&l, w);
+	check(watch_add(w, "he", 2) == 0, "add he");
+	check(watch_add(w, "she", 3) == 1, "add she");
+	check(watch_add(w, "his", 3) == 2, "add his");
+	check(watch_add(w, "hers", 4) == 3, "add hers");
+
+	feed(w, &l, "ushers");
+	/* "she" and "he" end on the same 'e', lowest index first */
+	check(!strcmp(l.hits, "013"), "ushers: %s", l.hits);
+
+	log_init(&l, w);
+	feed(w, &l, " ahishers");
+	check(!strcmp(l.hits, "2013"), "ahishers: %s", l.hits);
+
+	/* Overlapping occurrences of the same pattern all count */
+	log_init(&l, w);
+	check(watch_add(w, "aa", 2) == 4, "add aa");
+	feed(w, &l, "aaaa");
+	check(!strcmp(l.hits, "444"), "aaaa: %s", l.hits);
+
+	free(w);
+}
+
+/*
+ * A node's outputs include those of its fail link: "abcd" walks down
+ * its own branch, yet "bc" and "c" end there too.
+ */
+static void test_fail_outputs(void)
+{
+	struct watch *w = watch_new();
+	struct log l;
+
+	log_init(&l, w);
+	watch_add(w, "abcd", 4);
+	watch_add(w, "bc", 2);
+	watch_add(w, "c", 1);
+	watch_add(w, "bcx", 3);
+
+	feed(w, &l, "abcd");
+	check(!strcmp(l.hits, "120"), "abcd: %s", l.hits);
+
+	/* Off "abc" onto the fail link, and on to "bcx" from there */
+	log_init(&l, w);
+	feed(w, &l, "abcx");
+	check(!strcmp(l.hits, "123"), "abcx: %s", l.hits);
+
+	free(w);
+}
+
+/* Console output comes in whatever chunks the UART hands over */
+static void test_chunks(void)
+{
+	static const char *text = "boot: Kernel panic - not syncing";
+	struct watch *w = watch_new();
+	int len = strlen(text);
+	struct log l;
+
+	watch_add(w, "Kernel panic", 12);
+	watch_add(w, "panic - not", 11);
+
+	for (int step = 1; step <= len; step++) {
+		log_init(&l, w);
+		for (int i = 0; i < len; i += step) {
+			int n = i + step > len ? len - i : step;
+
+			watch_feed(w, text + i, n, log_match, &l);
+		}
+		check(!strcmp(l.hits, "01"), "step %d: %s", step, l.hits);
+	}
+
+	free(w);
+}
+
+/* A callback changing the patterns under watch_feed() */
+static void test_del_in_match(void)
+{
+	struct watch *w = watch_new();
+	struct log l;
+
+	watch_add(w, "ab", 2);
+	watch_add(w, "abcd", 4);
+	watch_add(w, "b", 1);
+
+	/* "b" goes away on its first hit, and doesn't hit again */
+	log_init(&l, w);
+	l.del = 2;
+	feed(w, &l, "abcdab");
+	check(!strcmp(l.hits, "0210"), "del: %s", l.hits);
+	check(!w->feeding && !w->stale && !w->gone, "left over state");
+
+	/* The rebuilt trie no longer has it */
+	log_init(&l, w);
+	feed(w, &l, "bbb");
+	check(!l.nr, "deleted pattern hit: %s", l.hits);
+
+	/* Nor is its slot reused until the walk is over */
+	log_init(&l, w);
+	l.del = 0;
+	l.add = 0;
+	feed(w, &l, "ab");
+	check(!strcmp(l.hits, "0"), "add after del: %s", l.hits);
+	check(w->len[0] == 0 && w->len[2] == 2, "slot reused while feeding");
+
+	log_init(&l, w);
+	feed(w, &l, "abzz");
+	check(!strcmp(l.hits, "2"), "added pattern: %s", l.hits);
+
+	/* A change starts matching afresh, even mid-pattern */
+	log_init(&l, w);
+	l.del = 2;
+	feed(w, &l, "zzab");
+	feed(w, &l, "cd");
+	check(!strcmp(l.hits, "2"), "walk kept across a change: %s", l.hits);
+
+	free(w);
+}
+
+int main(void)
+{
+	test_overlap();
+	test_fail_outputs();
+	test_chunks();
+	test_del_in_match();
+
+	printf("%s\n", failures ? "FAILED" : "OK");
+	return !!failures;
+}
@@ -3,9 +3,13 @@
 
 #define CFG_TUSB_RHPORT0_MODE   OPT_MODE_DEVICE
 
-#define CFG_TUD_EP_MAX          5
+#ifndef CONFIG_USB_PD_PORT_COUNT
+#define CONFIG_USB_PD_PORT_COUNT 2
+#endif
 
-#define CFG_TUD_CDC             2
+/* One CDC per port, each with a notification and a data endpoint */
+#define CFG_TUD_CDC             CONFIG_USB_PD_PORT_COUNT
+#define CFG_TUD_EP_MAX          (2 * CFG_TUD_CDC + 1)
 
 #define CFG_TUD_CDC_EP_BUFSIZE  512
 #define CFG_TUD_CDC_RX_BUFSIZE  512
@@ -0,0 +1,59 @@
+// Vendor control requests, for host-side tooling
+
+#include "tusb.h"
+#include "m1-pd-bmc.h"
+#include "tcpm_driver.h"
+#include "pdtrace.h"
+
+static uint64_t timebase;
+static uint8_t trace_buf[1024];
+
+bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage,
+				tusb_control_request_t const *req)
+{
+	int port = req->wIndex;
+
+	/* The only request with an OUT data stage, and not per-port */
+	if (req->bRequest == CS_REQ_TIMEBASE) {
+		if (stage == CONTROL_STAGE_SETUP)
+			return tud_control_xfer(rhport, req, &timebase,
+						sizeof(timebase));
+		if (stage == CONTROL_STAGE_DATA)
+			uart_set_timebase(timebase);
+		return true;
+	}
+
+	/* Everything else is handled at SETUP time */
+	if (stage != CONTROL_STAGE_SETUP)
+		return true;
+
+	/* Whatever the ports have traced, whole records only */
+	if (req->bRequest == CS_REQ_TRACE_READ)
+		return tud_control_xfer(rhport, req, trace_buf,
+					pdtrace_read(trace_buf,
+						     MIN(req->wLength,
+							 sizeof(trace_buf))));
+
+	if (port >= CONFIG_USB_PD_PORT_COUNT || !get_hw_from_port(port))
+		return false;
+
+	switch (req->bRequest) {
+	case CS_REQ_RAW:
+		upstream_set_raw(port, req->wValue);
+		return tud_control_status(rhport, req);
+	case CS_REQ_TIMESTAMPS:
+		uart_set_timestamps(port, req->wValue);
+		return tud_control_status(rhport, req);
+	case CS_REQ_TRACE:
+		pdtrace_enable(port, req->wValue);
+		return tud_control_status(rhport, req);
+	case CS_REQ_PD_STATS:
+		return tud_control_xfer(rhport, req, trace_buf,
+					pd_stats_read(port, trace_buf,
+						      MIN(req->wLength,
+							  sizeof(trace_buf)),
+						      req->wValue));
+	}
+
+	return false;
+}
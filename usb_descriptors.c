@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "tusb.h"
 #include "pico/unique_id.h"
 #include "m1-pd-bmc.h"
@@ -11,9 +13,8 @@ enum {
 	USBD_STR_MANUFACTURER,      // 1
 	USBD_STR_PRODUCT,           // 2
 	USBD_STR_SERIAL_NUMBER,     // 3
-	USBD_STR_CDC_0_NAME,        // 4
-	USBD_STR_CDC_1_NAME,        // 5
-	USBD_STR_LAST,
+	USBD_STR_CDC_NAME,          // 4, one per port
+	USBD_STR_LAST = USBD_STR_CDC_NAME + CFG_TUD_CDC,
 };
 
 static const tusb_desc_device_t usbd_desc_device = {
@@ -33,11 +34,14 @@ static const tusb_desc_device_t usbd_desc_device = {
 	.bNumConfigurations         = 1,
 };
 
-#define EPNUM_CDC_0_CMD         (0x81)
-#define EPNUM_CDC_0_DATA        (0x82)
+/* Port n gets 0x81 + 2n for notifications, and the next one for data */
+#define EPNUM_CDC_CMD(n)        (0x81 + 2 * (n))
+#define EPNUM_CDC_DATA(n)       (0x82 + 2 * (n))
 
-#define EPNUM_CDC_1_CMD         (0x83)
-#define EPNUM_CDC_1_DATA        (0x84)
+/* The RP2040 has 16 endpoints, EP0 included */
+#if EPNUM_CDC_DATA(CFG_TUD_CDC - 1) > 0x8f
+#error "Too many ports for the USB endpoints"
+#endif
 
 #define USBD_CDC_CMD_SIZE       (64)
 #define USBD_CDC_DATA_SIZE      (64)
@@ -47,38 +51,42 @@ static const tusb_desc_device_t usbd_desc_device = {
 #define USBD_DESC_LEN           (TUD_CONFIG_DESC_LEN + \
 				 TUD_CDC_DESC_LEN * CFG_TUD_CDC)
 
-enum {
-	ITF_NUM_CDC_0,
-	ITF_NUM_CDC_0_DATA,
-	ITF_NUM_CDC_1,
-	ITF_NUM_CDC_1_DATA,
-	ITF_NUM_TOTAL,
-};
+/* Control and data interfaces for each port */
+#define ITF_NUM_CDC(n)          (2 * (n))
+#define ITF_NUM_TOTAL           ITF_NUM_CDC(CFG_TUD_CDC)
 
-static const uint8_t usbd_desc_cfg[USBD_DESC_LEN] = {
-
-	TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL,
-			      USBD_STR_LANGUAGE,
-			      USBD_DESC_LEN,
-			      TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP,
-			      USBD_MAX_POWER_MA),
-
-	TUD_CDC_DESCRIPTOR(ITF_NUM_CDC_0,
-			   USBD_STR_CDC_0_NAME,
-			   EPNUM_CDC_0_CMD,
-			   USBD_CDC_CMD_SIZE,
-			   EPNUM_CDC_0_DATA & 0x7F,
-			   EPNUM_CDC_0_DATA,
-			   USBD_CDC_DATA_SIZE),
-
-	TUD_CDC_DESCRIPTOR(ITF_NUM_CDC_1,
-			   USBD_STR_CDC_1_NAME,
-			   EPNUM_CDC_1_CMD,
-			   USBD_CDC_CMD_SIZE,
-			   EPNUM_CDC_1_DATA & 0x7F,
-			   EPNUM_CDC_1_DATA,
-			   USBD_CDC_DATA_SIZE),
-};
+static uint8_t usbd_desc_cfg[USBD_DESC_LEN];
+
+/* Built on first use, one CDC function per port */
+static void usbd_desc_cfg_build(void)
+{
+	const uint8_t cfg[] = {
+		TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL,
+				      USBD_STR_LANGUAGE,
+				      USBD_DESC_LEN,
+				      TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP,
+				      USBD_MAX_POWER_MA),
+	};
+	uint8_t *p = usbd_desc_cfg;
+
+	memcpy(p, cfg, sizeof(cfg));
+	p += sizeof(cfg);
+
+	for (int i = 0; i < CFG_TUD_CDC; i++) {
+		const uint8_t cdc[] = {
+			TUD_CDC_DESCRIPTOR(ITF_NUM_CDC(i),
+					   USBD_STR_CDC_NAME + i,
+					   EPNUM_CDC_CMD(i),
+					   USBD_CDC_CMD_SIZE,
+					   EPNUM_CDC_DATA(i) & 0x7F,
+					   EPNUM_CDC_DATA(i),
+					   USBD_CDC_DATA_SIZE),
+		};
+
+		memcpy(p, cdc, sizeof(cdc));
+		p += sizeof(cdc);
+	}
+}
 
 const uint8_t *tud_descriptor_device_cb(void)
 {
@@ -88,6 +96,10 @@ const uint8_t *tud_descriptor_device_cb(void)
 const uint8_t *tud_descriptor_configuration_cb(uint8_t index)
 {
 	(void)index;
+
+	if (!usbd_desc_cfg[0])
+		usbd_desc_cfg_build();
+
 	return usbd_desc_cfg;
 }
 
@@ -139,14 +151,15 @@ const uint16_t *tud_descriptor_string_cb(uint8_t index, uint16_t langid)
 		str8_to_str16("Central Scrutinizer", desc_str);
 		break;
 
-	case USBD_STR_CDC_0_NAME:
-		str8_to_str16("Port-0", desc_str);
-		break;
+	default: {
+		char str[DESC_STR_MAX_LENGTH];
 
-	case USBD_STR_CDC_1_NAME:
-		str8_to_str16("Port-1", desc_str);
+		snprintf(str, DESC_STR_MAX_LENGTH, "Port-%d",
+			 index - USBD_STR_CDC_NAME);
+		str8_to_str16(str, desc_str);
 		break;
 	}
+	}
 
 	return desc_str;
 }
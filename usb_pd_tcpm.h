@@ -140,6 +140,9 @@ extern "C" {
 #define PD_HEADER_ID(header)   (((header) >> 9) & 7)
 #define PD_HEADER_REV(header)  (((header) >> 6) & 3)
 
+#define PACKET_IS_GOOD_CRC(head) (PD_HEADER_TYPE(head) == PD_CTRL_GOOD_CRC && \
+				  PD_HEADER_CNT(head) == 0)
+
 /* Used for processing pd extended header */
 #define PD_EXT_HEADER_CHUNKED(header)   (((header) >> 15) & 1)
 #define PD_EXT_HEADER_CHUNK_NUM(header) (((header) >> 11) & 0xf)
@@ -3,17 +3,263 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "tcpm_driver.h"
 #include "FUSB302.h"
 #include "m1-pd-bmc.h"
+#include "swar.h"
+#include "pdtrace.h"
+#include "watch.h"
 #include "hardware/watchdog.h"
 #include "hardware/sync.h"
 #include "pico/bootrom.h"
 
+/*
+ * Maximum amount of work done on a port's data paths each time the
+ * run loop visits it, before moving on to the next port.
+ */
+#define HOST_RX_QUANTUM		64
+#define UART_RX_QUANTUM		256
+
+/* Service latency we'd like to stay under, in us */
+#ifndef SERVICE_LATENCY_BOUND_US
+#define SERVICE_LATENCY_BOUND_US	2000
+#endif
+
+/* Longest command line accepted after ^_ : */
+#define CMDLINE_SIZE		64
+#define CMDLINE_MAX_ARGS	8
+
+/* How long to wait for the UART TX FIFO to drain when it is full */
+#define UART_TX_RETRY_US	100
+
+/* How often source caps are resent until the Mac answers */
+#define SOURCE_CAP_RETRY_US	(150 * 1000)
+
+/* How long VBUS is pulled down after we stop driving it */
+#define VBUS_DISCHARGE_US	(800 * 1000)
+
+/* Fast re-attach: how CC is debounced when we've seen this Mac before */
+#define CC_STABLE_POLL_MS	5
+#define CC_STABLE_READS		4
+#define CC_STABLE_MAX_POLLS	40
+
+enum attach_phase {
+	ATTACH_DEBOUNCE,	/* CC detected to VBUS on */
+	ATTACH_CONTRACT,	/* VBUS on to source caps acknowledged */
+	ATTACH_SERIAL,		/* Serial claimed to the Mac's ACK */
+	ATTACH_DONE,
+	ATTACH_NR_PHASES = ATTACH_DONE,
+};
+
+/* Per-phase attach timings, and what we know from the last attach */
+struct attach_stats {
+	uint64_t			phase_us;
+	uint32_t			last_us[ATTACH_NR_PHASES];
+	uint32_t			min_us[ATTACH_NR_PHASES];
+	uint32_t			max_us[ATTACH_NR_PHASES];
+	uint32_t			count;
+	uint32_t			fast_count;
+	bool				valid;
+	bool				cc_line;
+	bool				fast;
+	/* CC being debounced */
+	int16_t				cc1;
+	int16_t				cc2;
+	uint8_t				polls;
+	uint8_t				stable;
+};
+
+/* Port bring-up: VBUS discharge and CC settling, and re-probing */
+#define SETUP_SETTLE_US		(800 * 1000)
+#define SETUP_REPROBE_US	(2 * 1000 * 1000)
+
+enum setup_state {
+	SETUP_PROBE,		/* Looking for a FUSB302 */
+	SETUP_SETTLE,		/* Waiting for VBUS and CC to settle */
+	SETUP_DONE,
+};
+
+/*
+ * Warm restart: enough to pick up where we left off, kept in RAM that
+ * the C runtime leaves alone. It is only trusted if a watchdog scratch
+ * register (which survives a watchdog reset, but not a power cycle)
+ * holds the magic value and the checksum matches.
+ */
+#define WARM_SCRATCH		0
+
+struct warm_port {
+	struct fusb302_chip_state	chip;
+	int8_t				state;
+	int8_t				found;
+	uint8_t				serial_pin_set;
+	uint8_t				version;
+	bool				live;
+	bool				cc_line;
+	bool				vbus;
+	bool				serial_claimed;
+	bool				attach_valid;
+	bool				attach_cc_line;
+};
+
+struct warm_state {
+	struct warm_port		port[CONFIG_USB_PD_PORT_COUNT];
+	uint32_t			csum;
+};
+
+#define WARM_MAGIC		(0x57a4d000 ^ sizeof(struct warm_state))
+
+/* Software pacing of the DUT-bound data, all delays in us */
+struct pacing {
+	uint32_t			byte_us;
+	uint32_t			line_us;
+	uint32_t			echo_us;	/* 0: no echo sync */
+	uint64_t			next_us;
+	uint64_t			echo_deadline;
+	volatile bool			wait_echo;
+	volatile bool			armed;
+};
+
+/*
+ * Breaks are timed by an alarm, so nothing waits for them. They queue
+ * up back to back, with the line idle for BREAK_GAP_MS in between, and
+ * host data is held until the last one is over (think SysRq).
+ */
+#define BREAK_QUEUE_LEN		8
+#define BREAK_GAP_MS		20
+#define BREAK_DEFAULT_MS	100
+
+struct break_queue {
+	uint16_t			ms[BREAK_QUEUE_LEN];
+	volatile uint8_t		head;
+	volatile uint8_t		tail;
+	volatile bool			on;
+	volatile alarm_id_t		alarm;	/* 0 when nothing is timed */
+};
+
+/* Apple VDM command types, in the VDM header */
+#define VDM_CMDT_MASK		(3 << 6)
+#define VDM_CMDT_ACK		(1 << 6)
+#define VDM_CMDT_NAK		(2 << 6)
+#define VDM_CMDT_BUSY		(3 << 6)
+
+/* How long the Mac gets to answer, and how many times we ask */
+#define VDM_RESPONSE_US		(30 * 1000)
+#define VDM_RETRIES		3
+#define VDM_QUEUE_LEN		8
+
+struct vdm_context;
+
+struct vdm_request {
+	const char			*name;
+	uint32_t			vdm[3];
+	uint8_t				nr_u32;
+	bool				retry;	/* Safe to resend on timeout */
+	/* Called on ACK, and on NAK or lack of answer */
+	void				(*ack)(struct vdm_context *cxt);
+	void				(*fail)(struct vdm_context *cxt);
+};
+
+/* Requests are sent one at a time, the head being in flight */
+struct vdm_queue {
+	struct vdm_request		req[VDM_QUEUE_LEN];
+	uint64_t			sent_us;
+	alarm_id_t			alarm;
+	uint8_t				head;
+	uint8_t				tail;
+	uint8_t				tries;
+	bool				busy;	/* Mac said BUSY */
+};
+
+/*
+ * Serial pin set discovery: a pin set that isn't connected leaves
+ * the RX line low, which the UART reports as a break. It only does so
+ * once when the line falls, which may be before we look, so the line
+ * level is sampled as well. Anything else (traffic or an idle line)
+ * is good enough.
+ */
+#define PROBE_WINDOW_US		(500 * 1000)
+#define PROBE_SAMPLE_US		(50 * 1000)
+
+struct pin_probe {
+	uint64_t			deadline;
+	uint64_t			window_end;
+	uint32_t			good;
+	uint32_t			errors;
+	alarm_id_t			alarm;
+	int8_t				found;	/* Known to work, -1 if none */
+	uint8_t				first;
+	uint8_t				tried;	/* Bitmap of pin sets */
+	bool				enabled;
+	bool				active;
+	bool				sampling;
+	bool				seen_high;	/* RX not stuck low */
+};
+
+/* What to do when the DUT console matches a watched pattern */
+enum watch_action_type {
+	WATCH_LOG,
+	WATCH_REBOOT,
+	WATCH_BREAK,
+	WATCH_SEND,
+	WATCH_SOAK,		/* Internal, see soak_match() */
+	WATCH_NR_ACTIONS,
+};
+
+#define WATCH_KEYS_LEN		16
+
+struct watch_action {
+	uint64_t			last_us;
+	uint32_t			hits;
+	uint8_t				type;
+	uint8_t				keys_len;
+	char				keys[WATCH_KEYS_LEN];
+};
+
+/*
+ * Reboot soak: reboot the DUT, time the first byte of output and the
+ * "boot complete" pattern, wait for the console to settle, repeat.
+ */
+#define SOAK_MAX_CYCLES		512
+#define SOAK_QUIET_US		(2 * 1000 * 1000)
+
+enum soak_state {
+	SOAK_IDLE,
+	SOAK_SETTLE,		/* Waiting for the console to go quiet */
+	SOAK_REBOOT,		/* Reboot sent, waiting for the first byte */
+	SOAK_BOOT,		/* Waiting for the pattern */
+};
+
+struct soak {
+	uint64_t			start_us;
+	uint64_t			last_rx_us;
+	uint64_t			timeout_us;
+	uint32_t			ttfb_ms[SOAK_MAX_CYCLES];
+	uint32_t			ttp_ms[SOAK_MAX_CYCLES];
+	uint16_t			cycles;
+	uint16_t			done;
+	uint16_t			nr_ttfb;
+	uint16_t			nr_ttp;
+	uint16_t			no_output;
+	uint16_t			no_pattern;
+	alarm_id_t			alarm;
+	int8_t				watch;
+	uint8_t				state;
+};
+
+struct service_stats {
+	uint64_t			total_us;
+	uint32_t			max_us;
+	uint32_t			count;
+	uint32_t			over;
+};
+
 enum state {
 	STATE_INVALID = -1,
 	STATE_DISCONNECTED = 0,
+	STATE_VBUS_DISCHARGE,
+	STATE_DFP_DEBOUNCE,
 	STATE_READY,
 	STATE_DFP_VBUS_ON,
 	STATE_DFP_CONNECTED,
@@ -24,22 +270,58 @@ enum state {
 struct vdm_context {
 	const struct hw_context		*hw;
 	enum state			state;
+	enum setup_state		setup;
+	bool				setup_quiet;
+	uint64_t			setup_us;
+	alarm_id_t			setup_alarm;
 	int16_t				std_flag;
-	int16_t				source_cap_timer;
+	uint64_t			source_cap_us;
+	alarm_id_t			source_cap_alarm;
+	uint64_t			state_us;	/* Discharge, debounce */
+	alarm_id_t			state_alarm;
+	struct attach_stats		attach;
 	int16_t				cc_debounce;
-	volatile bool			pending;
+	volatile uint32_t		events;
+	uint32_t			wake_us;
+	struct service_stats		latency;
+	struct pd_counter		stats[PD_STAT_NR];
+	struct break_queue		brk;
+	struct pacing			pace;
+	char				tx_buf[HOST_RX_QUANTUM];
+	uint8_t				tx_len;
+	uint8_t				tx_pos;
+	char				cmd[CMDLINE_SIZE];
+	uint8_t				cmd_len;
+	bool				cmd_active;
+	struct watch			watch;
+	struct watch_action		watch_act[WATCH_MAX_PATTERNS];
+	struct soak			soak;
+	struct vdm_queue		vdmq;
+	struct pin_probe		probe;
 	bool 				verbose;
 	bool				vdm_escape;
 	bool				cc_line;
+	bool				vbus;
+	bool				serial_claimed;
 	uint8_t				serial_pin_set;
+	uint8_t				rx_mod;
 	uint8_t				version;
 };
 
 static struct vdm_context vdm_contexts[CONFIG_USB_PD_PORT_COUNT];
 
+static struct warm_state __uninitialized_ram(warm);
+static bool warm_boot;
+
+/* Ports being brought up have a hw_context, but aren't usable yet */
+static bool port_live(struct vdm_context *cxt)
+{
+	return cxt->hw && cxt->setup == SETUP_DONE;
+}
+
 #define PIN(cxt, idx)	(cxt)->hw->pins[(idx)].pin
 #define PORT(cxt)	((cxt) - vdm_contexts)
-#define UART(cxt)	(cxt)->hw->uart
+#define TCPM(cxt)	((cxt)->hw->tcpm)
 
 #define HIGH true
 #define LOW false
@@ -63,12 +345,71 @@ static struct vdm_context vdm_contexts[CONFIG_USB_PD_PORT_COUNT];
 		cprintf(cxt, "S: " #x "\n");				\
 	} while(0)
 
-static void vbus_off(struct vdm_context *cxt)
+static int64_t port_timeout(alarm_id_t id, void *data)
+{
+	struct vdm_context *cxt = data;
+
+	m1_pd_bmc_wake(PORT(cxt), EVT_TIMER);
+	return 0;
+}
+
+/*
+ * Get an EVT_TIMER at @when, replacing whatever @alarm was set to.
+ * EVT_TIMER handlers check their own deadlines, so spurious events
+ * are harmless.
+ */
+static void port_timer_arm(struct vdm_context *cxt, alarm_id_t *alarm,
+			   uint64_t when)
+{
+	if (*alarm > 0)
+		cancel_alarm(*alarm);
+
+	*alarm = add_alarm_at(from_us_since_boot(when), port_timeout,
+			      cxt, true);
+	if (*alarm < 0) {
+		*alarm = 0;
+		m1_pd_bmc_wake(PORT(cxt), EVT_TIMER);
+	}
+}
+
+/* Start a new attach phase, accounting for the previous one */
+static void attach_phase(struct vdm_context *cxt, enum attach_phase phase)
 {
+	struct attach_stats *a = &cxt->attach;
+	uint64_t now = time_us_64();
+
+	if (phase) {
+		uint32_t us = now - a->phase_us;
+
+		a->last_us[phase - 1] = us;
+		a->max_us[phase - 1] = MAX(a->max_us[phase - 1], us);
+		if (!a->min_us[phase - 1] || us < a->min_us[phase - 1])
+			a->min_us[phase - 1] = us;
+	}
+
+	a->phase_us = now;
+}
+
+/*
+ * Only wait for VBUS to discharge if we actually drove it, in which
+ * case it stays pulled down until state_timer() lets go. Returns true
+ * while that is going on.
+ */
+static bool vbus_off(struct vdm_context *cxt)
+{
+	bool discharge = cxt->vbus || cxt->state == STATE_VBUS_DISCHARGE;
+
 	gpio_put(PIN(cxt, FUSB_VBUS), LOW);
-	sleep_ms(800);
-	gpio_set_dir(PIN(cxt, FUSB_VBUS), GPIO_IN);
+	if (cxt->vbus) {
+		cxt->state_us = time_us_64() + VBUS_DISCHARGE_US;
+		port_timer_arm(cxt, &cxt->state_alarm, cxt->state_us);
+	} else if (!discharge) {
+		gpio_set_dir(PIN(cxt, FUSB_VBUS), GPIO_IN);
+	}
+	cxt->vbus = false;
 	cprintf(cxt, "Turning VBUS OFF\n");
+
+	return discharge;
 }
 
 static void vbus_on(struct vdm_context *cxt)
@@ -76,6 +417,38 @@ static void vbus_on(struct vdm_context *cxt)
 	cprintf(cxt, "Turning VBUS ON\n");
 	gpio_set_dir(PIN(cxt, FUSB_VBUS), GPIO_OUT);
 	gpio_put(PIN(cxt, FUSB_VBUS), HIGH);
+	cxt->vbus = true;
+}
+
+static void pd_stat(struct vdm_context *cxt, enum pd_stat stat)
+{
+	cxt->stats[stat].count++;
+	cxt->stats[stat].last_us = host_time_us();
+}
+
+/* Everything sent goes through here, to end up in the trace */
+static void pd_transmit(struct vdm_context *cxt, enum tcpm_transmit_type type,
+			uint16_t hdr, const uint32_t *data)
+{
+	uint64_t us = host_time_us();
+	uint8_t retries;
+
+	pd_stat(cxt, PD_STAT_TX);
+	TCPM(cxt)->transmit(PORT(cxt), type, hdr, data);
+	/* The PHY fills in the MessageID, but the time is when it started */
+	if (pdtrace_enabled(PORT(cxt))) {
+		TCPM(cxt)->get_tx_status(PORT(cxt), &hdr, &retries);
+		pdtrace_tx(PORT(cxt), (enum pdtrace_sop)type, hdr, data, us);
+	}
+}
+
+static void pd_tx_done(struct vdm_context *cxt, enum pdtrace_tx_result result)
+{
+	uint16_t hdr;
+	uint8_t retries;
+
+	TCPM(cxt)->get_tx_status(PORT(cxt), &hdr, &retries);
+	pdtrace_tx_done(PORT(cxt), result, retries);
 }
 
 void debug_poke(struct vdm_context *cxt)
@@ -84,51 +457,144 @@ void debug_poke(struct vdm_context *cxt)
 	const uint32_t x = 0;
 
 	dprintf(cxt, "Empty debug message\n");
-	fusb302_tcpm_transmit(PORT(cxt), TCPC_TX_SOP_DEBUG_PRIME_PRIME, hdr, &x);
+	pd_transmit(cxt, TCPC_TX_SOP_DEBUG_PRIME_PRIME, hdr, &x);
 }
 
-static void evt_dfpconnect(struct vdm_context *cxt, int16_t cc1, int16_t cc2)
+/* Debounce done, power the Mac up */
+static void evt_dfpattach(struct vdm_context *cxt, int16_t cc1, int16_t cc2)
 {
-	int ms = 200;
-
-	cprintf(cxt, "Connected: cc1=%d cc2=%d\n", cc1, cc2);
-
-	/* The original FUSB302 needs a bit longer... */
-	if ((cxt->version & 0xf0) < 0x90)
-		ms += 300;
-	sleep_ms(ms);
-	fusb302_tcpm_set_vconn(PORT(cxt), 0);
+	TCPM(cxt)->set_vconn(PORT(cxt), 0);
 
-	fusb302_pd_reset(PORT(cxt));
-	fusb302_tcpm_set_msg_header(PORT(cxt), 1, 1);	// Source
+	TCPM(cxt)->pd_reset(PORT(cxt));
+	TCPM(cxt)->set_msg_header(PORT(cxt), 1, 1);	// Source
 	cxt->cc_line = !(cc1 > cc2);
-	fusb302_tcpm_set_polarity(PORT(cxt), cxt->cc_line);
+	TCPM(cxt)->set_polarity(PORT(cxt), cxt->cc_line);
 	cprintf(cxt, "Polarity: CC%d (%s)\n",
 		(int)cxt->cc_line + 1, cxt->cc_line ? "flipped" : "normal");
 
 	/* If none of the CCs are disconnected, enable VCONN */
 	if (cc1 && cc2) {
-		fusb302_tcpm_set_vconn(PORT(cxt), 1);
+		TCPM(cxt)->set_vconn(PORT(cxt), 1);
 		cprintf(cxt, "VCONN on CC%d\n", (int)cxt->cc_line + 1);
 	}
 
-	fusb302_tcpm_set_rx_enable(PORT(cxt), 1);
+	TCPM(cxt)->set_rx_enable(PORT(cxt), 1);
 	vbus_on(cxt);
+	attach_phase(cxt, ATTACH_CONTRACT);
 	STATE(cxt, DFP_VBUS_ON);
 
+	/* Source caps go out on VBUSOK, or when this expires */
+	cxt->source_cap_us = time_us_64() + SOURCE_CAP_RETRY_US;
+	port_timer_arm(cxt, &cxt->source_cap_alarm, cxt->source_cap_us);
+
 	debug_poke(cxt);
 }
 
+/* The long way. The original FUSB302 needs a bit longer... */
+static void cc_debounce_slow(struct vdm_context *cxt)
+{
+	int ms = 200;
+
+	if ((cxt->version & 0xf0) < 0x90)
+		ms += 300;
+
+	cxt->attach.fast = false;
+	cxt->state_us = time_us_64() + ms * 1000;
+	port_timer_arm(cxt, &cxt->state_alarm, cxt->state_us);
+}
+
+/*
+ * Fast path: CC has to read the same a few times in a row, polled
+ * from the timer. Takes the long way if it doesn't settle.
+ */
+static void cc_debounce_timer(struct vdm_context *cxt)
+{
+	struct attach_stats *a = &cxt->attach;
+	int16_t cc1, cc2;
+
+	if (!a->fast) {
+		evt_dfpattach(cxt, a->cc1, a->cc2);
+		return;
+	}
+
+	TCPM(cxt)->get_cc(PORT(cxt), &cc1, &cc2);
+	if (cc1 == a->cc1 && cc2 == a->cc2) {
+		a->stable++;
+	} else {
+		a->cc1 = cc1;
+		a->cc2 = cc2;
+		a->stable = 0;
+	}
+
+	if (a->stable == CC_STABLE_READS) {
+		if (cc1 < 2 && cc2 < 2) {
+			cprintf(cxt, "Gone while debouncing\n");
+			STATE(cxt, DISCONNECTED);
+			return;
+		}
+
+		evt_dfpattach(cxt, cc1, cc2);
+		return;
+	}
+
+	if (++a->polls == CC_STABLE_MAX_POLLS) {
+		cc_debounce_slow(cxt);
+		return;
+	}
+
+	cxt->state_us = time_us_64() + CC_STABLE_POLL_MS * 1000;
+	port_timer_arm(cxt, &cxt->state_alarm, cxt->state_us);
+}
+
+static void evt_dfpconnect(struct vdm_context *cxt, int16_t cc1, int16_t cc2)
+{
+	struct attach_stats *a = &cxt->attach;
+
+	cprintf(cxt, "Connected: cc1=%d cc2=%d\n", cc1, cc2);
+	attach_phase(cxt, ATTACH_DEBOUNCE);
+	STATE(cxt, DFP_DEBOUNCE);
+
+	a->cc1 = cc1;
+	a->cc2 = cc2;
+	a->polls = 0;
+	a->stable = 0;
+
+	/*
+	 * Same orientation as the last successful attach, most likely
+	 * the Mac rebooting: go as soon as CC settles. Otherwise, take
+	 * the long way. Either way, cc_debounce_timer() takes it from
+	 * there.
+	 */
+	a->fast = a->valid && a->cc_line == !(cc1 > cc2);
+	if (!a->fast) {
+		cc_debounce_slow(cxt);
+		return;
+	}
+
+	cxt->state_us = time_us_64() + CC_STABLE_POLL_MS * 1000;
+	port_timer_arm(cxt, &cxt->state_alarm, cxt->state_us);
+}
+
+static void vdmq_flush(struct vdm_context *cxt);
+
 static void evt_disconnect(struct vdm_context *cxt)
 {
-	vbus_off(cxt);
+	bool discharge = vbus_off(cxt);
+
 	cprintf(cxt, "Disconnected\n");
-	fusb302_pd_reset(PORT(cxt));
-	fusb302_tcpm_set_vconn(PORT(cxt), 0);
-	fusb302_tcpm_set_rx_enable(PORT(cxt), 0);
-	fusb302_tcpm_select_rp_value(PORT(cxt), TYPEC_RP_USB);
-	fusb302_tcpm_set_cc(PORT(cxt), TYPEC_CC_RP);	// DFP mode
-	STATE(cxt, DISCONNECTED);
+	TCPM(cxt)->pd_reset(PORT(cxt));
+	TCPM(cxt)->set_vconn(PORT(cxt), 0);
+	TCPM(cxt)->set_rx_enable(PORT(cxt), 0);
+	TCPM(cxt)->select_rp_value(PORT(cxt), TYPEC_RP_USB);
+	TCPM(cxt)->set_cc(PORT(cxt), TYPEC_CC_RP);	// DFP mode
+	/* Nobody left to answer pending VDMs */
+	vdmq_flush(cxt);
+	cxt->serial_claimed = false;
+	cxt->probe.active = false;
+	if (discharge)
+		STATE(cxt, VBUS_DISCHARGE);
+	else
+		STATE(cxt, DISCONNECTED);
 }
 
 static void send_power_request(struct vdm_context *cxt, uint32_t cap)
@@ -140,7 +606,7 @@ static void send_power_request(struct vdm_context *cxt, uint32_t cap)
 		(4L << 10) | // Random mA operating
 		(4L << 0);   // Random mA max
 
-	fusb302_tcpm_transmit(PORT(cxt), TCPC_TX_SOP, hdr, &req);
+	pd_transmit(cxt, TCPC_TX_SOP, hdr, &req);
 	cprintf(cxt, ">REQUEST\n");
 	(void)cap;
 }
@@ -153,7 +619,7 @@ static void send_sink_cap(struct vdm_context *cxt)
 		(0L << 10) | // 0mA operating
 		(0L << 0);   // 0mA max
 
-	fusb302_tcpm_transmit(PORT(cxt), TCPC_TX_SOP, hdr, &cap);
+	pd_transmit(cxt, TCPC_TX_SOP, hdr, &cap);
 	cprintf(cxt, ">SINK_CAP\n");
 	STATE(cxt, READY);
 }
@@ -163,16 +629,16 @@ static void send_source_cap(struct vdm_context *cxt)
 	int16_t hdr = PD_HEADER(PD_DATA_SOURCE_CAP, 1, 1, 0, 1, PD_REV20, 0);
 	uint32_t cap = 1UL << 31; /* Variable non-battery PS, 0V, 0mA */
 
-	fusb302_tcpm_transmit(PORT(cxt), TCPC_TX_SOP, hdr, &cap);
+	pd_transmit(cxt, TCPC_TX_SOP, hdr, &cap);
 	cprintf(cxt, ">SOURCE_CAP\n");
-	cxt->source_cap_timer = 0;
+	cxt->source_cap_us = time_us_64() + SOURCE_CAP_RETRY_US;
+	port_timer_arm(cxt, &cxt->source_cap_alarm, cxt->source_cap_us);
 }
 
-static void dump_msg(struct vdm_context *cxt,
-		     enum fusb302_rxfifo_tokens sop, int16_t hdr, uint32_t * msg)
+static void dump_msg(struct vdm_context *cxt, const struct pd_msg *m)
 {
-	int16_t len = PD_HEADER_CNT(hdr);
-	switch (sop) {
+	int16_t len = PD_HEADER_CNT(m->header);
+	switch (m->sop) {
 	case fusb302_TKN_SOP:
 		cprintf_cont(cxt, "RX SOP (");
 		break;
@@ -193,9 +659,9 @@ static void dump_msg(struct vdm_context *cxt,
 		break;
 	}
 
-	cprintf_cont(cxt, "%d) [%x]", len, hdr);
-	for (int16_t i = 0; i < PD_HEADER_CNT(hdr); i++)
-		cprintf_cont(cxt, " %lx", msg[i]);
+	cprintf_cont(cxt, "%d) [%x]", len, m->header);
+	for (int16_t i = 0; i < len; i++)
+		cprintf_cont(cxt, " %lx", m->data[i]);
 
 	cprintf_cont(cxt, "\n");
 }
@@ -218,7 +684,7 @@ static void handle_discover_identity(struct vdm_context *cxt)
 		0x100L	// bcdDevice
 	};
 
-	fusb302_tcpm_transmit(PORT(cxt), TCPC_TX_SOP, hdr, vdm);
+	pd_transmit(cxt, TCPC_TX_SOP, hdr, vdm);
 	cprintf(cxt, ">VDM DISCOVER_IDENTITY\n");
 }
 
@@ -226,7 +692,7 @@ static void handle_power_request(struct vdm_context *cxt, uint32_t req)
 {
 	int16_t hdr = PD_HEADER(PD_CTRL_ACCEPT, 1, 1, 0, 0, PD_REV20, 0);
 
-	fusb302_tcpm_transmit(PORT(cxt), TCPC_TX_SOP, hdr, NULL);
+	pd_transmit(cxt, TCPC_TX_SOP, hdr, NULL);
 	cprintf(cxt, ">ACCEPT\n");
 	STATE(cxt, DFP_ACCEPT);
 }
@@ -234,7 +700,7 @@ static void handle_power_request(struct vdm_context *cxt, uint32_t req)
 static void send_ps_rdy(struct vdm_context *cxt)
 {
 	int16_t hdr = PD_HEADER(PD_CTRL_PS_RDY, 1, 1, 0, 0, PD_REV20, 0);
-	fusb302_tcpm_transmit(PORT(cxt), TCPC_TX_SOP, hdr, NULL);
+	pd_transmit(cxt, TCPC_TX_SOP, hdr, NULL);
 	cprintf(cxt, ">PS_RDY\n");
 
 	STATE(cxt, IDLE);
@@ -244,15 +710,18 @@ static void send_reject(struct vdm_context *cxt)
 {
 	int16_t hdr = PD_HEADER(PD_CTRL_REJECT, 1, 1, 0, 0, PD_REV20, 0);
 
-	fusb302_tcpm_transmit(PORT(cxt), TCPC_TX_SOP, hdr, NULL);
+	pd_transmit(cxt, TCPC_TX_SOP, hdr, NULL);
 	cprintf(cxt, ">REJECT\n");
 
 	STATE(cxt, IDLE);
 }
 
-static void handle_vdm(struct vdm_context *cxt, enum fusb302_rxfifo_tokens sop,
-		       int16_t hdr, uint32_t *msg)
+static void vdmq_response(struct vdm_context *cxt, const uint32_t *msg);
+
+static void handle_vdm(struct vdm_context *cxt, const struct pd_msg *m)
 {
+	const uint32_t *msg = m->data;
+
 	switch (*msg) {
 	case 0xff008001:	// Structured VDM: DISCOVER IDENTITY
 		cprintf(cxt, "<VDM DISCOVER_IDENTITY\n");
@@ -261,16 +730,17 @@ static void handle_vdm(struct vdm_context *cxt, enum fusb302_rxfifo_tokens sop,
 		break;
 	default:
 		cprintf(cxt, "<VDM ");
-		dump_msg(cxt, sop, hdr, msg);
+		dump_msg(cxt, m);
+		vdmq_response(cxt, msg);
 		break;
 	}
 }
 
-static void handle_msg(struct vdm_context *cxt, enum fusb302_rxfifo_tokens sop,
-		       int16_t hdr, uint32_t *msg)
+static void handle_msg(struct vdm_context *cxt, const struct pd_msg *m)
 {
-	int16_t len = PD_HEADER_CNT(hdr);
-	int16_t type = PD_HEADER_TYPE(hdr);
+	int16_t len = PD_HEADER_CNT(m->header);
+	int16_t type = PD_HEADER_TYPE(m->header);
+	const uint32_t *msg = m->data;
 
 	if (len != 0) {
 		switch (type) {
@@ -283,11 +753,11 @@ static void handle_msg(struct vdm_context *cxt, enum fusb302_rxfifo_tokens sop,
 			handle_power_request(cxt, msg[0]);
 			break;
 		case PD_DATA_VENDOR_DEF:
-			handle_vdm(cxt, sop, hdr, msg);
+			handle_vdm(cxt, m);
 			break;
 		default:
 			cprintf(cxt, "<UNK DATA ");
-			dump_msg(cxt, sop, hdr, msg);
+			dump_msg(cxt, m);
 			break;
 		}
 	} else {
@@ -315,35 +785,60 @@ static void handle_msg(struct vdm_context *cxt, enum fusb302_rxfifo_tokens sop,
 			break;
 		default:
 			cprintf(cxt, "<UNK CTL ");
-			dump_msg(cxt, sop, hdr, msg);
+			dump_msg(cxt, m);
 			break;
 		}
 	}
 }
 
+static enum pdtrace_sop sop_to_trace(enum fusb302_rxfifo_tokens sop)
+{
+	switch (sop) {
+	case fusb302_TKN_SOP1:
+		return PDTRACE_SOP1;
+	case fusb302_TKN_SOP2:
+		return PDTRACE_SOP2;
+	case fusb302_TKN_SOP1DB:
+		return PDTRACE_SOP1_DEBUG;
+	case fusb302_TKN_SOP2DB:
+		return PDTRACE_SOP2_DEBUG;
+	default:
+		return PDTRACE_SOP;
+	}
+}
+
+/* The descriptor is handled and traced in place, then recycled */
 static void evt_packet(struct vdm_context *cxt)
 {
-	int16_t hdr, ret;
-	enum fusb302_rxfifo_tokens sop;
-	uint32_t msg[16];
+	struct pd_msg *m;
 
-	ret = fusb302_tcpm_get_message(PORT(cxt), msg, &hdr, &sop);
-	if (ret) {
-		// No packet or GoodCRC
+	m = TCPM(cxt)->get_message(PORT(cxt));
+	if (!m) {
+		// No packet
 		return;
 	}
 
-	handle_msg(cxt, sop, hdr, msg);
+	pdtrace_rx(PORT(cxt), sop_to_trace(m->sop), m->header, m->data);
+	pd_stat(cxt, PD_STAT_RX_SOP + sop_to_trace(m->sop));
+
+	/* Acks for what we sent, nothing to act on */
+	if (PACKET_IS_GOOD_CRC(m->header))
+		pd_stat(cxt, PD_STAT_GOODCRC);
+	else
+		handle_msg(cxt, m);
+
+	pd_msg_put(m);
 }
 
-static void vdm_claim_serial(struct vdm_context *cxt);
+static void serial_attach(struct vdm_context *cxt);
 
 static void evt_sent(struct vdm_context *cxt)
 {
 	switch (cxt->state) {
 	case STATE_DFP_VBUS_ON:
 		STATE(cxt, DFP_CONNECTED);
-		vdm_claim_serial(cxt);
+		attach_phase(cxt, ATTACH_SERIAL);
+		serial_attach(cxt);
 		break;
 	case STATE_DFP_ACCEPT:
 		send_ps_rdy(cxt);
@@ -353,15 +848,25 @@ static void evt_sent(struct vdm_context *cxt)
 	}
 }
 
+/*
+ * Whatever the TCPC has received, GoodCRCs included, so that the
+ * trace sees them before the TX they answer is reported done.
+ */
+static void rx_drain(struct vdm_context *cxt)
+{
+	while (!TCPM(cxt)->rx_fifo_is_empty(PORT(cxt)))
+		evt_packet(cxt);
+}
+
 static void handle_irq(struct vdm_context *cxt)
 {
 	int16_t irq, irqa, irqb;
-	fusb302_get_irq(PORT(cxt), &irq, &irqa, &irqb);
+	TCPM(cxt)->get_irq(PORT(cxt), &irq, &irqa, &irqb);
 
 	dprintf(cxt, "IRQ=%x %x %x\n", irq, irqa, irqb);
 	if (irq & TCPC_REG_INTERRUPT_VBUSOK) {
 		cprintf(cxt, "IRQ: VBUSOK (VBUS=");
-		if (fusb302_tcpm_get_vbus_level(PORT(cxt))) {
+		if (TCPM(cxt)->get_vbus_level(PORT(cxt))) {
 			cprintf_cont(cxt, "ON)\n");
 			send_source_cap(cxt);
 			debug_poke(cxt);
@@ -372,16 +877,30 @@ static void handle_irq(struct vdm_context *cxt)
 	}
 	if (irqa & TCPC_REG_INTERRUPTA_HARDRESET) {
 		cprintf(cxt, "IRQ: HARDRESET\n");
+		pd_stat(cxt, PD_STAT_HARD_RESET_RX);
+		pdtrace_rx(PORT(cxt), PDTRACE_HARD_RESET, 0, NULL);
 		evt_disconnect(cxt);
 	}
+	if (irq & TCPC_REG_INTERRUPT_COLLISION)
+		pd_stat(cxt, PD_STAT_COLLISION);
+	if (irqa & TCPC_REG_INTERRUPTA_HARDSENT)
+		pd_stat(cxt, PD_STAT_HARD_RESET_TX);
+	if (irqa & TCPC_REG_INTERRUPTA_RETRYFAIL) {
+		dprintf(cxt, "IRQ: RETRYFAIL\n");
+		pd_stat(cxt, PD_STAT_TX_FAIL);
+		rx_drain(cxt);
+		pd_tx_done(cxt, PDTRACE_TX_FAILED);
+	}
 	if (irqa & TCPC_REG_INTERRUPTA_TX_SUCCESS) {
 		//cprintf(cxt, "IRQ: TXSUCCESS\n");
+		pd_stat(cxt, PD_STAT_TX_OK);
+		rx_drain(cxt);
+		pd_tx_done(cxt, PDTRACE_TX_SUCCESS);
 		evt_sent(cxt);
 	}
 	if (irqb & TCPC_REG_INTERRUPTB_GCRCSENT) {
 		//cprintf(cxt, "IRQ: GCRCSENT\n");
-		while (!fusb302_rx_fifo_is_empty(PORT(cxt)))
-			evt_packet(cxt);
+		rx_drain(cxt);
 	}
 }
 
@@ -393,13 +912,167 @@ static void vdm_send_msg(struct vdm_context *cxt, const uint32_t *vdm, int nr_u3
 	}
 	cprintf(cxt, "\n");
 	int16_t hdr = PD_HEADER(PD_DATA_VENDOR_DEF, 1, 1, 0, nr_u32, PD_REV20, 0);
-	fusb302_tcpm_transmit(PORT(cxt), TCPC_TX_SOP_DEBUG_PRIME_PRIME, hdr, vdm);
+	pd_transmit(cxt, TCPC_TX_SOP_DEBUG_PRIME_PRIME, hdr, vdm);
+}
+
+static bool vdmq_empty(struct vdm_context *cxt)
+{
+	return cxt->vdmq.head == cxt->vdmq.tail;
+}
+
+/* Drop everything, so that the next attach starts afresh */
+static void vdmq_flush(struct vdm_context *cxt)
+{
+	struct vdm_queue *q = &cxt->vdmq;
+
+	if (q->alarm > 0)
+		cancel_alarm(q->alarm);
+	q->alarm = 0;
+	q->head = q->tail;
+	q->tries = 0;
+	q->busy = false;
+}
+
+static void vdmq_send(struct vdm_context *cxt)
+{
+	struct vdm_queue *q = &cxt->vdmq;
+	struct vdm_request *r = &q->req[q->head];
+
+	q->tries++;
+	q->busy = false;
+	q->sent_us = time_us_64();
+	vdm_send_msg(cxt, r->vdm, r->nr_u32);
+	port_timer_arm(cxt, &q->alarm, q->sent_us + VDM_RESPONSE_US);
+}
+
+/* Retire the request in flight, and fire the next one */
+static void vdmq_next(struct vdm_context *cxt, bool failed)
+{
+	struct vdm_queue *q = &cxt->vdmq;
+	void (*fail)(struct vdm_context *) = q->req[q->head].fail;
+
+	q->tries = 0;
+	q->head = (q->head + 1) % VDM_QUEUE_LEN;
+
+	if (!vdmq_empty(cxt))
+		vdmq_send(cxt);
+
+	/* Last, as it is likely to queue something else */
+	if (failed && fail)
+		fail(cxt);
+}
+
+static bool vdm_queue(struct vdm_context *cxt, const struct vdm_request *r)
+{
+	struct vdm_queue *q = &cxt->vdmq;
+	uint8_t next = (q->tail + 1) % VDM_QUEUE_LEN;
+	bool idle = vdmq_empty(cxt);
+
+	if (next == q->head) {
+		cprintf(cxt, "VDM queue full, dropping %s\n", r->name);
+		return false;
+	}
+
+	q->req[q->tail] = *r;
+	q->tail = next;
+
+	if (idle)
+		vdmq_send(cxt);
+
+	return true;
+}
+
+/* Match an answer from the Mac with the request in flight */
+static void vdmq_response(struct vdm_context *cxt, const uint32_t *msg)
+{
+	struct vdm_queue *q = &cxt->vdmq;
+	struct vdm_request *r = &q->req[q->head];
+
+	if (vdmq_empty(cxt) || (msg[0] & ~VDM_CMDT_MASK) != r->vdm[0])
+		return;
+
+	switch (msg[0] & VDM_CMDT_MASK) {
+	case VDM_CMDT_ACK:
+		cprintf(cxt, "<VDM %s ACK (try %d, %lluus)\n", r->name,
+			q->tries, time_us_64() - q->sent_us);
+		if (r->ack)
+			r->ack(cxt);
+		vdmq_next(cxt, false);
+		break;
+	case VDM_CMDT_NAK:
+		cprintf(cxt, "<VDM %s NAK\n", r->name);
+		vdmq_next(cxt, true);
+		break;
+	case VDM_CMDT_BUSY:
+		/* Not acted upon, resent when the timer expires */
+		q->busy = true;
+		break;
+	}
+}
+
+/*
+ * Resend on timeout, but only if the request is harmless to repeat:
+ * the Mac may well have acted on a reboot before its answer got lost.
+ * A BUSY answer means nothing happened, so that's always retried.
+ */
+static void vdmq_timer(struct vdm_context *cxt)
+{
+	struct vdm_queue *q = &cxt->vdmq;
+	struct vdm_request *r = &q->req[q->head];
+
+	if (vdmq_empty(cxt))
+		return;
+
+	if (time_us_64() < q->sent_us + VDM_RESPONSE_US) {
+		port_timer_arm(cxt, &q->alarm, q->sent_us + VDM_RESPONSE_US);
+		return;
+	}
+
+	if (q->tries < VDM_RETRIES && (r->retry || q->busy)) {
+		cprintf(cxt, "VDM %s %s, retrying\n",
+			r->name, q->busy ? "busy" : "timed out");
+		vdmq_send(cxt);
+		return;
+	}
+
+	cprintf(cxt, "VDM %s: no answer\n", r->name);
+	vdmq_next(cxt, true);
 }
 
+enum vdm_action {
+	VDM_ACT_REBOOT,
+	VDM_ACT_DFU,
+	VDM_ACT_PD_RESET,
+	VDM_ACT_LIST,
+};
+
+static const struct vdm_request vdm_actions[] = {
+	[VDM_ACT_REBOOT]	= {
+		.name	= "reboot",
+		.vdm	= { 0x5ac8012, 0x0105, 0x8000UL << 16 },
+		.nr_u32	= 3,
+	},
+	[VDM_ACT_DFU]		= {	/* PMU Reset + DFU Hold */
+		.name	= "dfu",
+		.vdm	= { 0x5ac8012, 0x0105, 0x8002UL << 16 },
+		.nr_u32	= 3,
+	},
+	[VDM_ACT_PD_RESET]	= {
+		.name	= "pd-reset",
+		.vdm	= { 0x5ac8012, 0x0103, 0x8000UL << 16 },
+		.nr_u32	= 3,
+	},
+	[VDM_ACT_LIST]		= {	/* Get Action List */
+		.name	= "actions",
+		.vdm	= { 0x5ac8010 },
+		.nr_u32	= 1,
+		.retry	= true,
+	},
+};
+
 static void vdm_pd_reset(struct vdm_context *cxt)
 {
-	uint32_t vdm[] = { 0x5ac8012, 0x0103, 0x8000<<16 };
-	vdm_send_msg(cxt, vdm, ARRAY_SIZE(vdm));
+	vdm_queue(cxt, &vdm_actions[VDM_ACT_PD_RESET]);
 	cprintf(cxt, ">VDM SET ACTION PD reset\n");
 }
 
@@ -407,21 +1080,79 @@ static const char *pinsets[] = {
 	"AltUSB", "PrimUSB", "SBU1/2",
 };
 
+static const char *rx_mods[] = {
+	[UART_RX_MOD_AUTO]	= "auto",
+	[UART_RX_MOD_LOW]	= "low-latency",
+	[UART_RX_MOD_HIGH]	= "bulk",
+};
+
+static void attach_report(struct vdm_context *cxt)
+{
+	static const char *phases[] = {
+		[ATTACH_DEBOUNCE]	= "debounce",
+		[ATTACH_CONTRACT]	= "contract",
+		[ATTACH_SERIAL]		= "serial",
+	};
+	struct attach_stats *a = &cxt->attach;
+
+	cprintf(cxt, "Attach: %lu (%lu fast), last known polarity %s\n",
+		a->count, a->fast_count,
+		!a->valid ? "none" : a->cc_line ? "CC2" : "CC1");
+
+	for (int i = 0; i < ATTACH_NR_PHASES; i++)
+		cprintf(cxt, "  %-8s last %lums min %lums max %lums\n", phases[i],
+			a->last_us[i] / 1000, a->min_us[i] / 1000,
+			a->max_us[i] / 1000);
+}
+
+/* The serial lines are ours, this attach is a keeper */
+static void serial_acked(struct vdm_context *cxt)
+{
+	struct attach_stats *a = &cxt->attach;
+
+	/* Only the claim that follows an attach counts */
+	if (a->phase_us == 0)
+		return;
+
+	attach_phase(cxt, ATTACH_DONE);
+	boot_mark(BOOT_SERIAL, PORT(cxt));
+	a->phase_us = 0;
+	a->valid = true;
+	a->cc_line = cxt->cc_line;
+	a->count++;
+	if (a->fast)
+		a->fast_count++;
+
+	cprintf(cxt, "Attached in %lums (%s)\n",
+		(a->last_us[ATTACH_DEBOUNCE] + a->last_us[ATTACH_CONTRACT] +
+		 a->last_us[ATTACH_SERIAL]) / 1000, a->fast ? "fast" : "slow");
+}
+
+/*
+ * Once serial has been claimed, the route can be changed on the fly
+ * without dropping the PD contract. Only if the Mac refuses do we go
+ * the long way, resetting the link and claiming serial from scratch.
+ */
 static void vdm_claim_serial(struct vdm_context *cxt)
 {
 	bool usb_serial, sbu_swap;
 
-	//uint32_t vdm[] = { 0x5ac8010 }; // Get Action List
-	//uint32_t vdm[] = { 0x5ac8012, 0x0105, 0x8002<<16 }; // PMU Reset + DFU Hold
 	//uint32_t vdm[] = { 0x5ac8011, 0x0809  }; // Get Action List
-	//uint32_t vdm[] = { 0x5ac8012, 0x0105, 0x8000<<16 };
 
 	// Maybe SWD?
-	uint32_t vdm[] = { 0x5AC8012, 0x01800206 };
+	struct vdm_request r = {
+		.name	= "serial",
+		.vdm	= { 0x5AC8012, 0x01800206 },
+		.nr_u32	= 2,
+		.retry	= true,
+		.ack	= serial_acked,
+		.fail	= cxt->serial_claimed ? vdm_pd_reset : NULL,
+	};
 
-	vdm[1] |= 1 << (cxt->serial_pin_set + 16);
+	r.vdm[1] |= 1 << (cxt->serial_pin_set + 16);
 
-	vdm_send_msg(cxt, vdm, ARRAY_SIZE(vdm));
+	vdm_queue(cxt, &r);
+	cxt->serial_claimed = true;
 	cprintf(cxt, ">VDM serial -> %s\n", pinsets[cxt->serial_pin_set]);
 
 	/* If using the SBU pins, swap the pins if using CC2. */
@@ -433,144 +1164,1304 @@ static void vdm_claim_serial(struct vdm_context *cxt)
 	dprintf(cxt, "SBU_SWAP = %d, SEL_USB = %d\n", sbu_swap, usb_serial);
 }
 
-void vdm_send_reboot(struct vdm_context *cxt)
+static void probe_start(struct vdm_context *cxt)
 {
-	uint32_t vdm[] = { 0x5ac8012, 0x0105, 0x8000UL<<16 };
-	vdm_send_msg(cxt, vdm, ARRAY_SIZE(vdm));
-	cprintf(cxt, ">VDM SET ACTION reboot\n");
-}
+	struct pin_probe *p = &cxt->probe;
 
-static void serial_out(struct vdm_context *cxt, char c)
-{
-	uart_putc_raw(UART(cxt), c);
+	p->tried |= 1 << cxt->serial_pin_set;
+	p->sampling = false;
+	p->deadline = time_us_64() + VDM_RESPONSE_US;
+	port_timer_arm(cxt, &p->alarm, p->deadline);
 }
 
-static void help(struct vdm_context *cxt)
+static void probe_timer(struct vdm_context *cxt)
 {
-	cprintf(cxt, "Current port\n"
-		"^_    Escape character\n"
-		"^_ ^_ Raw ^_\n"
-		"^_ !  DUT reset\n"
-		"^_ ^R Central Scrutinizer reset\n"
-		"^_ ^^ Central Scrutinizer reset to programming mode\n"
-		"^_ ^X Force disconnect\n"
-		"^_ ^D Toggle debug\n"
-		"^_ ^M Send empty debug VDM\n"
-		"^_ 1  Serial on Primary USB pins\n"
-		"^_ 2  Serial on SBU pins\n");
-
-	if (upstream_is_serial())
-		cprintf_cont(cxt, "^_ ^@  Send break\n");
-	if (PORT(cxt) == 0 && !vdm_contexts[1].hw)
-		cprintf_cont(cxt, "^_ ^U  Switch upstream port USB/Serial\n");
-	cprintf_cont(cxt, "^_ ?  This message\n");
+	struct pin_probe *p = &cxt->probe;
+	uint32_t good, errors, lost;
+	int next;
 
-	for (int i = 0; i < CONFIG_USB_PD_PORT_COUNT; i++) {
-		struct vdm_context *tmp = &vdm_contexts[i];
+	if (!p->active)
+		return;
 
-		cprintf(cxt, "Port %d: %s",
-			PORT(tmp),
-			tmp->hw ? "present" : "absent");
-		if (tmp->hw)
-			cprintf_cont(cxt, ",cc%d,%s,%s%s",
-				     tmp->cc_line + 1,
-				     pinsets[tmp->serial_pin_set],
-				     upstream_is_serial() ? "serial" : "USB",
-				     tmp->verbose ? ",debug" : "");
-		cprintf_cont(cxt, "\n");
+	if (time_us_64() < p->deadline) {
+		port_timer_arm(cxt, &p->alarm, p->deadline);
+		return;
 	}
-}
 
-/* Break is handled as sideband data via the CDC layer */
-void tud_cdc_send_break_cb(uint8_t itf, uint16_t duration_ms)
-{
-	struct vdm_context *cxt;
+	uart_rx_stats(PORT(cxt), &good, &errors, &lost);
+
+	/* Give the Mac time to route the lines before looking at them */
+	if (!p->sampling) {
+		p->sampling = true;
+		p->good = good;
+		p->errors = errors;
+		p->seen_high = gpio_get(PIN(cxt, UART_RX));
+		p->window_end = time_us_64() + PROBE_WINDOW_US;
+		p->deadline = time_us_64() + PROBE_SAMPLE_US;
+		port_timer_arm(cxt, &p->alarm, p->deadline);
+		return;
+	}
 
-	if (itf > CONFIG_USB_PD_PORT_COUNT)
+	p->seen_high |= gpio_get(PIN(cxt, UART_RX));
+	if (time_us_64() < p->window_end) {
+		p->deadline = MIN(time_us_64() + PROBE_SAMPLE_US, p->window_end);
+		port_timer_arm(cxt, &p->alarm, p->deadline);
 		return;
+	}
 
-	cxt = &vdm_contexts[itf];
+	good -= p->good;
+	errors -= p->errors;
 
-	if (!cxt->hw)
+	/* Held low all along is dead, even without a break to show for it */
+	if (good || (!errors && p->seen_high)) {
+		p->active = false;
+		if (good)
+			p->found = cxt->serial_pin_set;
+		cprintf(cxt, "Serial on %s is %s\n",
+			pinsets[cxt->serial_pin_set], good ? "alive" : "idle");
 		return;
+	}
 
-	/* Section 6.2.15 of the spec has the recipe */
-	uart_set_break(UART(cxt), !!duration_ms);
-	if (duration_ms && duration_ms != (uint16_t)~0) {
-		sleep_ms(duration_ms);
-		uart_set_break(UART(cxt), 0);
+	cprintf(cxt, "Serial on %s looks dead\n", pinsets[cxt->serial_pin_set]);
+
+	for (next = 1; next < ARRAY_SIZE(pinsets); next++)
+		if (!(p->tried & (1 << next)))
+			break;
+
+	if (next == ARRAY_SIZE(pinsets)) {
+		p->active = false;
+		cxt->serial_pin_set = p->first;
+		cprintf(cxt, "No working serial pin set, back to %s\n",
+			pinsets[p->first]);
+		vdm_claim_serial(cxt);
+		return;
 	}
+
+	cxt->serial_pin_set = next;
+	vdm_claim_serial(cxt);
+	probe_start(cxt);
 }
 
-static bool serial_handler(struct vdm_context *cxt)
+static void probe_begin(struct vdm_context *cxt)
 {
-	bool uart_active = false;
-	int32_t c;
+	struct pin_probe *p = &cxt->probe;
 
-	while ((c = upstream_ops->rx_byte(PORT(cxt))) != -1) {
-		uart_active = true;
+	p->first = cxt->serial_pin_set;
+	p->tried = 0;
+	p->active = true;
+	probe_start(cxt);
+}
 
-		if ((!cxt->vdm_escape && c != 0x1f)) {
-			serial_out(cxt, c);
-			continue;
-		}
+/* Claim serial on attach, starting with what worked last time */
+static void serial_attach(struct vdm_context *cxt)
+{
+	struct pin_probe *p = &cxt->probe;
 
-		switch (c) {
-		case '!':			/* ! */
-			vdm_send_reboot(cxt);
-			break;
-		case 0x12:			/* ^R */
-			watchdog_enable(1, 1);
+	if (p->enabled && p->found >= 0)
+		cxt->serial_pin_set = p->found;
+
+	vdm_claim_serial(cxt);
+
+	if (p->enabled)
+		probe_begin(cxt);
+}
+
+/* An explicit choice of pin set, which disables discovery */
+static void serial_set_pins(struct vdm_context *cxt, uint8_t pin_set)
+{
+	cxt->probe.enabled = false;
+	cxt->probe.active = false;
+	cxt->serial_pin_set = pin_set;
+
+	if (cxt->serial_claimed)
+		vdm_claim_serial(cxt);
+	else
+		vdm_pd_reset(cxt);
+}
+
+void vdm_send_reboot(struct vdm_context *cxt)
+{
+	vdm_queue(cxt, &vdm_actions[VDM_ACT_REBOOT]);
+	cprintf(cxt, ">VDM SET ACTION reboot\n");
+}
+
+static void serial_out(struct vdm_context *cxt, char c)
+{
+	uart_tx_bytes(PORT(cxt), &c, 1);
+}
+
+static void serial_out_bytes(struct vdm_context *cxt, const char *ptr, int len)
+{
+	uart_tx_bytes(PORT(cxt), ptr, len);
+}
+
+static bool serial_hw_flow(struct vdm_context *cxt)
+{
+	return !cxt->hw->pins[UART_CTS].skip;
+}
+
+static bool serial_paced(struct vdm_context *cxt)
+{
+	struct pacing *p = &cxt->pace;
+
+	return p->byte_us || p->line_us || p->echo_us;
+}
+
+static int64_t pacing_timeout(alarm_id_t id, void *data)
+{
+	struct vdm_context *cxt = data;
+
+	cxt->pace.armed = false;
+	m1_pd_bmc_wake(PORT(cxt), EVT_HOST_RX);
+	return 0;
+}
+
+/* Come back to the pending host data at @when */
+static void pacing_arm(struct vdm_context *cxt, uint64_t when)
+{
+	if (cxt->pace.armed)
+		return;
+
+	cxt->pace.armed = true;
+	if (add_alarm_at(from_us_since_boot(when), pacing_timeout,
+			 cxt, true) < 0) {
+		cxt->pace.armed = false;
+		m1_pd_bmc_wake(PORT(cxt), EVT_HOST_RX);
+	}
+}
+
+/*
+ * Send as much as the pacing constraints and the UART allow, without
+ * ever blocking. Returns the number of bytes actually sent.
+ */
+static int serial_tx(struct vdm_context *cxt, const char *buf, int len)
+{
+	struct pacing *p = &cxt->pace;
+	int i;
+
+	if (!serial_paced(cxt) && !serial_hw_flow(cxt)) {
+		serial_out_bytes(cxt, buf, len);
+		return len;
+	}
+
+	for (i = 0; i < len; i++) {
+		uint64_t now = time_us_64();
+
+		if (p->wait_echo && now < p->echo_deadline) {
+			pacing_arm(cxt, p->echo_deadline);
 			break;
-		case 0x1E:			/* ^^ */
-			reset_usb_boot(1 << PICO_DEFAULT_LED_PIN,0);
+		}
+
+		p->wait_echo = false;
+
+		if (now < p->next_us) {
+			pacing_arm(cxt, p->next_us);
 			break;
-		case 0x1F:			/* ^_ */
-			if (!cxt->vdm_escape) {
-				cxt->vdm_escape = true;
-				continue;
+		}
+
+		if (!uart_tx_ready(PORT(cxt))) {
+			pacing_arm(cxt, now + UART_TX_RETRY_US);
+			break;
+		}
+
+		serial_out(cxt, buf[i]);
+		p->next_us = now + p->byte_us;
+
+		if (buf[i] != '\r')
+			continue;
+
+		p->next_us = now + MAX(p->byte_us, p->line_us);
+		if (p->echo_us) {
+			p->echo_deadline = now + p->echo_us;
+			p->wait_echo = true;
+		}
+	}
+
+	return i;
+}
+
+static int64_t break_timeout(alarm_id_t id, void *data)
+{
+	struct vdm_context *cxt = data;
+	struct break_queue *b = &cxt->brk;
+
+	/* Next one, after a bit of idle line */
+	if (!b->on) {
+		uart_tx_break(PORT(cxt), true);
+		b->on = true;
+		return b->ms[b->tail] * 1000;
+	}
+
+	uart_tx_break(PORT(cxt), false);
+	b->on = false;
+	b->tail = (b->tail + 1) % BREAK_QUEUE_LEN;
+	if (b->head != b->tail)
+		return BREAK_GAP_MS * 1000;
+
+	/* Let the held host data through */
+	b->alarm = 0;
+	m1_pd_bmc_wake(PORT(cxt), EVT_HOST_RX);
+	return 0;
+}
+
+/*
+ * Queue a break of @duration_ms. 0 and ~0 are the host's "off" and
+ * "on until further notice" (section 6.2.15 of the CDC PSTN spec),
+ * which drop whatever is queued.
+ */
+static void serial_send_break(struct vdm_context *cxt, uint16_t duration_ms)
+{
+	struct break_queue *b = &cxt->brk;
+	uint32_t flags;
+	uint8_t next;
+
+	flags = save_and_disable_interrupts();
+
+	if (!duration_ms || duration_ms == (uint16_t)~0) {
+		if (b->alarm > 0)
+			cancel_alarm(b->alarm);
+		b->alarm = 0;
+		b->head = b->tail;
+		b->on = duration_ms;
+		uart_tx_break(PORT(cxt), b->on);
+		restore_interrupts(flags);
+
+		if (!b->on)
+			m1_pd_bmc_wake(PORT(cxt), EVT_HOST_RX);
+		return;
+	}
+
+	next = (b->head + 1) % BREAK_QUEUE_LEN;
+	if (next != b->tail) {
+		b->ms[b->head] = duration_ms;
+		b->head = next;
+	}
+
+	/* Nothing in progress, start right away */
+	if (!b->alarm) {
+		uart_tx_break(PORT(cxt), true);
+		b->on = true;
+		b->alarm = add_alarm_in_us(b->ms[b->tail] * 1000,
+					   break_timeout, cxt, true);
+		if (b->alarm < 0) {
+			uart_tx_break(PORT(cxt), false);
+			b->on = false;
+			b->alarm = 0;
+			b->head = b->tail;
+		}
+	}
+
+	restore_interrupts(flags);
+}
+
+/* A timed break or a sequence is in progress */
+static bool serial_breaking(struct vdm_context *cxt)
+{
+	return cxt->brk.alarm;
+}
+
+static const char *watch_actions[] = {
+	[WATCH_LOG]	= "log",
+	[WATCH_REBOOT]	= "reboot",
+	[WATCH_BREAK]	= "break",
+	[WATCH_SEND]	= "send",
+	[WATCH_SOAK]	= "soak",
+};
+
+/* Come back to soak_timer() at @when, whatever was planned before */
+static void soak_arm(struct vdm_context *cxt, uint64_t when)
+{
+	port_timer_arm(cxt, &cxt->soak.alarm, when);
+}
+
+static int soak_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void soak_print(struct vdm_context *cxt, const char *what,
+		       uint32_t *ms, int nr)
+{
+	if (!nr) {
+		cprintf(cxt, "  %-10s no samples\n", what);
+		return;
+	}
+
+	/* Order doesn't matter for anything else, sort in place */
+	qsort(ms, nr, sizeof(*ms), soak_cmp);
+	cprintf(cxt, "  %-10s min %lums median %lums p99 %lums max %lums\n",
+		what, ms[0], ms[(nr - 1) / 2], ms[(nr * 99 + 99) / 100 - 1],
+		ms[nr - 1]);
+}
+
+static void soak_report(struct vdm_context *cxt)
+{
+	struct soak *sk = &cxt->soak;
+
+	cprintf(cxt, "Soak: %d/%d cycles, %d without output, %d without pattern\n",
+		sk->done, sk->cycles, sk->no_output, sk->no_pattern);
+	soak_print(cxt, "first byte", sk->ttfb_ms, sk->nr_ttfb);
+	soak_print(cxt, "pattern", sk->ttp_ms, sk->nr_ttp);
+}
+
+static void soak_stop(struct vdm_context *cxt)
+{
+	struct soak *sk = &cxt->soak;
+
+	if (sk->alarm > 0)
+		cancel_alarm(sk->alarm);
+	sk->alarm = 0;
+
+	watch_del(&cxt->watch, sk->watch);
+	uart_rx_record(PORT(cxt), false);
+	sk->state = SOAK_IDLE;
+	soak_report(cxt);
+}
+
+/* A cycle is over, successfully or not. Let the console settle */
+static void soak_next(struct vdm_context *cxt)
+{
+	struct soak *sk = &cxt->soak;
+
+	if (++sk->done == sk->cycles) {
+		soak_stop(cxt);
+		return;
+	}
+
+	sk->state = SOAK_SETTLE;
+	sk->start_us = time_us_64();
+	soak_arm(cxt, MAX(sk->last_rx_us, sk->start_us) + SOAK_QUIET_US);
+}
+
+/*
+ * Deadline driven, so spurious calls are harmless. A console that
+ * never goes quiet gets rebooted anyway once the timeout expires.
+ */
+static void soak_timer(struct vdm_context *cxt)
+{
+	struct soak *sk = &cxt->soak;
+	uint64_t now = time_us_64();
+
+	switch (sk->state) {
+	case SOAK_IDLE:
+		return;
+	case SOAK_SETTLE:
+		if (now < sk->last_rx_us + SOAK_QUIET_US &&
+		    now < sk->start_us + sk->timeout_us) {
+			soak_arm(cxt, MIN(sk->last_rx_us + SOAK_QUIET_US,
+					  sk->start_us + sk->timeout_us));
+			return;
+		}
+
+		sk->state = SOAK_REBOOT;
+		/* Whatever comes first gets stamped */
+		uart_rx_record(PORT(cxt), true);
+		sk->start_us = time_us_64();
+		vdm_send_reboot(cxt);
+		soak_arm(cxt, sk->start_us + sk->timeout_us);
+		return;
+	case SOAK_REBOOT:
+	case SOAK_BOOT:
+		if (now < sk->start_us + sk->timeout_us) {
+			soak_arm(cxt, sk->start_us + sk->timeout_us);
+			return;
+		}
+
+		if (sk->state == SOAK_REBOOT)
+			sk->no_output++;
+		else
+			sk->no_pattern++;
+
+		cprintf(cxt, "Soak cycle %d timed out\n", sk->done + 1);
+		soak_next(cxt);
+		return;
+	}
+}
+
+/* @us is when the line being received started, if known */
+static void soak_rx(struct vdm_context *cxt, uint64_t us)
+{
+	struct soak *sk = &cxt->soak;
+
+	sk->last_rx_us = us ? us : time_us_64();
+
+	/* Leftovers from before the reboot don't count */
+	if (sk->state != SOAK_REBOOT || sk->last_rx_us < sk->start_us)
+		return;
+
+	sk->ttfb_ms[sk->nr_ttfb++] = (sk->last_rx_us - sk->start_us) / 1000;
+	sk->state = SOAK_BOOT;
+}
+
+static void soak_match(struct vdm_context *cxt)
+{
+	struct soak *sk = &cxt->soak;
+
+	if (sk->state != SOAK_BOOT)
+		return;
+
+	/* To the start of the line the pattern ends in */
+	sk->ttp_ms[sk->nr_ttp++] = (sk->last_rx_us - sk->start_us) / 1000;
+	soak_next(cxt);
+}
+
+static void watch_match(void *data, int idx)
+{
+	struct vdm_context *cxt = data;
+	struct watch_action *act = &cxt->watch_act[idx];
+
+	act->hits++;
+	act->last_us = time_us_64();
+
+	switch (act->type) {
+	case WATCH_LOG:
+		cprintf(cxt, "Watch #%d matched\n", idx);
+		break;
+	case WATCH_REBOOT:
+		vdm_send_reboot(cxt);
+		break;
+	case WATCH_BREAK:
+		serial_send_break(cxt, BREAK_DEFAULT_MS);
+		break;
+	case WATCH_SEND:
+		serial_out_bytes(cxt, act->keys, act->keys_len);
+		break;
+	case WATCH_SOAK:
+		soak_match(cxt);
+		break;
+	}
+}
+
+/* Called with each chunk of DUT output, before it goes upstream */
+void m1_pd_bmc_uart_rx(int32_t port, const char *buf, int len, uint64_t us)
+{
+	struct vdm_context *cxt = &vdm_contexts[port];
+
+	if (cxt->soak.state != SOAK_IDLE)
+		soak_rx(cxt, us);
+
+	if (!watch_empty(&cxt->watch) && !upstream_get_raw(port))
+		watch_feed(&cxt->watch, buf, len, watch_match, cxt);
+
+	if (cxt->pace.wait_echo && swar_find_byte(buf, len, '\n') < len) {
+		cxt->pace.wait_echo = false;
+		m1_pd_bmc_wake(port, EVT_HOST_RX);
+	}
+}
+
+static void help(struct vdm_context *cxt)
+{
+	cprintf(cxt, "Current port\n"
+		"^_    Escape character\n"
+		"^_ ^_ Raw ^_\n"
+		"^_ !  DUT reset\n"
+		"^_ ^R Central Scrutinizer reset\n"
+		"^_ ^^ Central Scrutinizer reset to programming mode\n"
+		"^_ ^X Force disconnect\n"
+		"^_ ^D Toggle debug\n"
+		"^_ ^M Send empty debug VDM\n"
+		"^_ 1  Serial on Primary USB pins\n"
+		"^_ 2  Serial on SBU pins\n"
+		"^_ :  Command line, try 'help'\n"
+		"^_ b  Raw binary mode until break or DTR toggle\n"
+		"^_ i  Cycle UART RX IRQ moderation\n"
+		"^_ l  Service latency statistics\n"
+		"^_ p  PD link statistics\n"
+		"^_ t  Toggle DUT output timestamps\n");
+
+	if (upstream_is_serial())
+		cprintf_cont(cxt, "^_ ^@  Send break\n");
+	if (PORT(cxt) == 0 && !port_live(&vdm_contexts[1]))
+		cprintf_cont(cxt, "^_ ^U  Switch upstream port USB/Serial\n");
+	cprintf_cont(cxt, "^_ ?  This message\n");
+
+	for (int i = 0; i < CONFIG_USB_PD_PORT_COUNT; i++) {
+		struct vdm_context *tmp = &vdm_contexts[i];
+
+		cprintf(cxt, "Port %d: %s",
+			PORT(tmp),
+			port_live(tmp) ? "present" :
+			tmp->hw ? "probing" : "absent");
+		if (port_live(tmp))
+			cprintf_cont(cxt, ",cc%d,%s,rx-%s,%s%s%s",
+				     tmp->cc_line + 1,
+				     pinsets[tmp->serial_pin_set],
+				     rx_mods[tmp->rx_mod],
+				     (upstream_is_serial() && !PORT(tmp)) ? "serial" : "USB",
+				     uart_get_timestamps(PORT(tmp)) ? ",ts" : "",
+				     tmp->verbose ? ",debug" : "");
+		cprintf_cont(cxt, "\n");
+	}
+}
+
+/* Break is handled as sideband data via the CDC layer */
+void tud_cdc_send_break_cb(uint8_t itf, uint16_t duration_ms)
+{
+	struct vdm_context *cxt;
+
+	if (itf >= CONFIG_USB_PD_PORT_COUNT)
+		return;
+
+	cxt = &vdm_contexts[itf];
+
+	if (!port_live(cxt))
+		return;
+
+	/* The break is consumed when it terminates raw mode */
+	if (duration_ms && (upstream_get_raw(itf) & RAW_EXIT_BREAK)) {
+		upstream_set_raw(itf, 0);
+		return;
+	}
+
+	serial_send_break(cxt, duration_ms);
+}
+
+static void latency_stats(struct vdm_context *cxt)
+{
+	for (int i = 0; i < CONFIG_USB_PD_PORT_COUNT; i++) {
+		struct vdm_context *tmp = &vdm_contexts[i];
+		struct service_stats *st = &tmp->latency;
+		uint32_t good, errors, lost;
+
+		if (!port_live(tmp))
+			continue;
+
+		cprintf(cxt, "Port %d: %lu events, avg %lluus, max %luus, %lu over %dus\n",
+			PORT(tmp), st->count,
+			st->count ? st->total_us / st->count : 0,
+			st->max_us, st->over, SERVICE_LATENCY_BOUND_US);
+
+		uart_rx_stats(PORT(tmp), &good, &errors, &lost);
+		cprintf(cxt, "Port %d: UART RX %lu good, %lu errors, %lu lost\n",
+			PORT(tmp), good, errors, lost);
+	}
+}
+
+static const char * const pd_stat_names[PD_STAT_NR] = {
+	[PD_STAT_TX]		= "tx",
+	[PD_STAT_TX_OK]		= "tx-ok",
+	[PD_STAT_TX_FAIL]	= "tx-retryfail",
+	[PD_STAT_COLLISION]	= "collision",
+	[PD_STAT_HARD_RESET_TX]	= "hardreset-tx",
+	[PD_STAT_HARD_RESET_RX]	= "hardreset-rx",
+	[PD_STAT_RX_SOP]	= "rx-sop",
+	[PD_STAT_RX_SOP1]	= "rx-sop'",
+	[PD_STAT_RX_SOP2]	= "rx-sop''",
+	[PD_STAT_RX_SOP1_DEBUG]	= "rx-sop'-dbg",
+	[PD_STAT_RX_SOP2_DEBUG]	= "rx-sop''-dbg",
+	[PD_STAT_GOODCRC]	= "goodcrc",
+};
+
+static void pd_stats(struct vdm_context *cxt)
+{
+	for (int i = 0; i < PD_STAT_NR; i++) {
+		struct pd_counter *c = &cxt->stats[i];
+
+		cprintf(cxt, "%-13s %8lu", pd_stat_names[i], c->count);
+		if (c->count)
+			cprintf_cont(cxt, ", last %llu.%06llu",
+				     c->last_us / 1000000, c->last_us % 1000000);
+		cprintf_cont(cxt, "\n");
+	}
+}
+
+int pd_stats_read(int32_t port, uint8_t *buf, int size, bool clear)
+{
+	struct vdm_context *cxt = &vdm_contexts[port];
+	int len = MIN(size, sizeof(cxt->stats));
+
+	memcpy(buf, cxt->stats, len);
+	if (clear)
+		memset(cxt->stats, 0, sizeof(cxt->stats));
+
+	return len;
+}
+
+static uint32_t warm_csum(void)
+{
+	const uint8_t *p = (const uint8_t *)warm.port;
+	uint32_t csum = 0;
+
+	for (int i = 0; i < sizeof(warm.port); i++)
+		csum = ((csum << 5) | (csum >> 27)) + p[i];
+
+	return csum;
+}
+
+static void warm_save(struct vdm_context *cxt)
+{
+	struct warm_port *w = &warm.port[PORT(cxt)];
+
+	*w = (struct warm_port) {
+		.state		= cxt->state,
+		.found		= cxt->probe.found,
+		.serial_pin_set	= cxt->serial_pin_set,
+		.version	= cxt->version,
+		.live		= port_live(cxt),
+		.cc_line	= cxt->cc_line,
+		.vbus		= cxt->vbus,
+		.serial_claimed	= cxt->serial_claimed,
+		.attach_valid	= cxt->attach.valid,
+		.attach_cc_line	= cxt->attach.cc_line,
+	};
+
+	fusb302_get_state(PORT(cxt), &w->chip);
+	warm.csum = warm_csum();
+}
+
+/* Make the next watchdog reset a warm one */
+static void warm_arm(void)
+{
+	for (int i = 0; i < CONFIG_USB_PD_PORT_COUNT; i++) {
+		if (vdm_contexts[i].hw)
+			warm_save(&vdm_contexts[i]);
+		else
+			warm.port[i].live = false;
+	}
+
+	warm.csum = warm_csum();
+	watchdog_hw->scratch[WARM_SCRATCH] = WARM_MAGIC;
+}
+
+static void warm_restart(void)
+{
+	warm_arm();
+	watchdog_enable(1, 1);
+}
+
+/*
+ * Called first thing at boot, before the GPIOs are configured. On a
+ * warm restart, put VBUS and the serial routing back the way they
+ * were, and return true so that these pins are left alone.
+ */
+bool m1_pd_bmc_warm_early(unsigned int port, const struct hw_context *hw)
+{
+	static bool checked;
+	struct warm_port *w = &warm.port[port];
+	bool sbu_swap = LOW, usb_serial = LOW;
+
+	if (!checked) {
+		checked = true;
+		warm_boot = (watchdog_hw->scratch[WARM_SCRATCH] == WARM_MAGIC &&
+			     warm.csum == warm_csum());
+		/* One shot, a crash later on must not look warm */
+		watchdog_hw->scratch[WARM_SCRATCH] = 0;
+	}
+
+	if (!warm_boot || port >= CONFIG_USB_PD_PORT_COUNT || !w->live)
+		return false;
+
+	if (w->serial_claimed) {
+		sbu_swap = (w->serial_pin_set == 2) ? w->cc_line : LOW;
+		usb_serial = (w->serial_pin_set == 1);
+	}
+
+	gpio_init(hw->pins[SBU_SWAP].pin);
+	gpio_set_dir(hw->pins[SBU_SWAP].pin, GPIO_OUT);
+	gpio_put(hw->pins[SBU_SWAP].pin, sbu_swap);
+
+	gpio_init(hw->pins[SEL_USB].pin);
+	gpio_set_dir(hw->pins[SEL_USB].pin, GPIO_OUT);
+	gpio_put(hw->pins[SEL_USB].pin, usb_serial);
+
+	gpio_init(hw->pins[FUSB_VBUS].pin);
+	if (w->vbus) {
+		gpio_set_dir(hw->pins[FUSB_VBUS].pin, GPIO_OUT);
+		gpio_put(hw->pins[FUSB_VBUS].pin, HIGH);
+	}
+
+	return true;
+}
+
+/* Port 1 while its UART is the serial upstream, see ^U */
+static const struct hw_context *port1_parked_hw;
+
+static void escape_handler(struct vdm_context *cxt, char c)
+{
+	switch (c) {
+	case '!':			/* ! */
+		vdm_send_reboot(cxt);
+		break;
+	case 0x12:			/* ^R */
+		warm_restart();
+		break;
+	case 0x1E:			/* ^^ */
+		reset_usb_boot(1 << PICO_DEFAULT_LED_PIN,0);
+		break;
+	case 0x1F:			/* ^_ */
+		if (!cxt->vdm_escape) {
+			cxt->vdm_escape = true;
+			return;
+		}
+
+		serial_out(cxt, c);
+		break;
+	case 4:				/* ^D */
+		cxt->verbose = !cxt->verbose;
+		cprintf(cxt, "Debug o%s\n", cxt->verbose ? "n" : "ff");
+		break;
+	case 0:				/* ^@ */
+		serial_send_break(cxt, BREAK_DEFAULT_MS);
+		break;
+	case '\r':			/* Enter */
+		debug_poke(cxt);
+		break;
+	case '1' ... '2':
+		serial_set_pins(cxt, c - '0');
+		break;
+	case 0x15:     			/* ^U */
+		/* We can't do that if port 1 is using UART1 */
+		if (PORT(cxt) != 0 || port_live(&vdm_contexts[1]))
+			break;
+
+		cprintf(cxt, "Upstream switching to %s\n",
+			!upstream_is_serial() ? "serial" : "USB");
+		if (!upstream_is_serial()) {
+			/* Port 1's UART is about to go, stop looking for its board */
+			port1_parked_hw = vdm_contexts[1].hw;
+			vdm_contexts[1].hw = NULL;
+			set_upstream_ops(true);
+		} else {
+			set_upstream_ops(false);
+			/* UART1 is back, and so may be a board behind it */
+			if (port1_parked_hw)
+				m1_pd_bmc_fusb_setup(1, port1_parked_hw);
+			port1_parked_hw = NULL;
+		}
+		cprintf(cxt, "Upstream is %s\n",
+			upstream_is_serial() ? "serial" : "USB");
+		break;
+	case 0x18:			/* ^X */
+		m1_pd_bmc_wake(PORT(cxt), EVT_PD_IRQ);
+		evt_disconnect(cxt);
+		break;
+	case ':':
+		cxt->cmd_active = true;
+		cxt->cmd_len = 0;
+		cprintf(cxt, "> ");
+		break;
+	case 'b':
+		upstream_set_raw(PORT(cxt), RAW_EXIT_BREAK | RAW_EXIT_DTR);
+		break;
+	case 'i':
+		cxt->rx_mod = (cxt->rx_mod + 1) % UART_RX_MOD_NR;
+		uart_set_rx_mod(PORT(cxt), cxt->rx_mod);
+		cprintf(cxt, "UART RX moderation: %s\n",
+			rx_mods[cxt->rx_mod]);
+		break;
+	case 'l':
+		latency_stats(cxt);
+		break;
+	case 'p':
+		pd_stats(cxt);
+		break;
+	case 't':
+		uart_set_timestamps(PORT(cxt), !uart_get_timestamps(PORT(cxt)));
+		cprintf(cxt, "Timestamps o%s\n",
+			uart_get_timestamps(PORT(cxt)) ? "n" : "ff");
+		break;
+	case '?':
+		help(cxt);
+		break;
+	}
+
+	cxt->vdm_escape = false;
+}
+
+static void cmd_help(struct vdm_context *cxt, int argc, char **argv);
+
+static void cmd_pace(struct vdm_context *cxt, int argc, char **argv)
+{
+	struct pacing *p = &cxt->pace;
+
+	if (argc == 2 && !strcmp(argv[1], "off")) {
+		p->byte_us = p->line_us = p->echo_us = 0;
+		p->wait_echo = false;
+	} else if (argc == 3 && !strcmp(argv[1], "byte")) {
+		p->byte_us = strtoul(argv[2], NULL, 0);
+	} else if (argc == 3 && !strcmp(argv[1], "line")) {
+		p->line_us = strtoul(argv[2], NULL, 0);
+	} else if (argc == 3 && !strcmp(argv[1], "echo")) {
+		p->echo_us = strtoul(argv[2], NULL, 0) * 1000;
+		p->wait_echo = false;
+	} else if (argc != 1) {
+		cprintf(cxt, "Usage: pace [off|byte <us>|line <us>|echo <timeout ms>]\n");
+		return;
+	}
+
+	cprintf(cxt, "Pacing: byte %luus, line %luus, echo %s (%lums), HW flow %s\n",
+		p->byte_us, p->line_us, p->echo_us ? "on" : "off",
+		p->echo_us / 1000, serial_hw_flow(cxt) ? "on" : "off");
+}
+
+static void cmd_baud(struct vdm_context *cxt, int argc, char **argv)
+{
+	if (argc == 2 && !uart_set_baud(PORT(cxt), strtoul(argv[1], NULL, 0))) {
+		cprintf(cxt, "Can't do %s baud on %s\n", argv[1],
+			cxt->hw->pio ? "PIO" : "UART");
+		return;
+	} else if (argc > 2) {
+		cprintf(cxt, "Usage: baud [<rate>]\n");
+		return;
+	}
+
+	cprintf(cxt, "%lu baud on %s\n", uart_get_baud(PORT(cxt)),
+		cxt->hw->pio ? "PIO" : "UART");
+}
+
+static void cmd_break(struct vdm_context *cxt, int argc, char **argv)
+{
+	if (argc == 1) {
+		serial_send_break(cxt, BREAK_DEFAULT_MS);
+		return;
+	}
+
+	for (int i = 1; i < argc; i++) {
+		unsigned long ms = strtoul(argv[i], NULL, 0);
+
+		if (!ms || ms >= (uint16_t)~0) {
+			cprintf(cxt, "Usage: break [<ms>...]\n");
+			return;
+		}
+	}
+
+	for (int i = 1; i < argc; i++)
+		serial_send_break(cxt, strtoul(argv[i], NULL, 0));
+}
+
+/* C-style escapes, plus \s for a space. Returns the decoded length */
+static int cmd_unescape(char *dst, const char *src, int size)
+{
+	int len = 0;
+
+	while (*src && len < size) {
+		char c = *src++;
+
+		if (c == '\\' && *src) {
+			switch ((c = *src++)) {
+			case 'r':
+				c = '\r';
+				break;
+			case 'n':
+				c = '\n';
+				break;
+			case 't':
+				c = '\t';
+				break;
+			case 's':
+				c = ' ';
+				break;
+			case 'x': {
+				char hex[3] = {};
+
+				for (int i = 0; i < 2 && isxdigit(*src); i++)
+					hex[i] = *src++;
+				c = strtoul(hex, NULL, 16);
+				break;
 			}
+			}
+		}
+
+		dst[len++] = c;
+	}
+
+	return len;
+}
+
+/* Glue the arguments back together, single-space separated */
+static void cmd_join(char *dst, int size, int argc, char **argv)
+{
+	dst[0] = '\0';
+
+	for (int i = 0; i < argc; i++) {
+		if (i)
+			strncat(dst, " ", size - strlen(dst) - 1);
+		strncat(dst, argv[i], size - strlen(dst) - 1);
+	}
+}
+
+static void cmd_watch(struct vdm_context *cxt, int argc, char **argv)
+{
+	struct watch *w = &cxt->watch;
+	char str[CMDLINE_SIZE], pat[WATCH_PATTERN_LEN];
+	struct watch_action act = {};
+	int i, len;
+
+	if (argc == 1) {
+		for (i = 0; i < WATCH_MAX_PATTERNS; i++) {
+			struct watch_action *a = &cxt->watch_act[i];
+
+			if (!w->len[i])
+				continue;
+
+			cprintf(cxt, "#%d %-6s hits %lu, last %llu.%06llu \"%.*s\"\n",
+				i, watch_actions[a->type], a->hits,
+				a->last_us / 1000000, a->last_us % 1000000,
+				w->len[i], w->pattern[i]);
+		}
+		return;
+	}
 
-			serial_out(cxt, c);
-			break;
-		case 4:				/* ^D */
-			cxt->verbose = !cxt->verbose;
-			cprintf(cxt, "Debug o%s\n", cxt->verbose ? "n" : "ff");
-			break;
-		case 0:				/* ^@ */
-			tud_cdc_send_break_cb(PORT(cxt), 100);
-			break;
-		case '\r':			/* Enter */
-			debug_poke(cxt);
-			break;
-		case '1' ... '2':
-			cxt->serial_pin_set = c - '0';
-			vdm_pd_reset(cxt);
+	/* The soak pattern goes away with the soak itself */
+	if (argc == 2 && !strcmp(argv[1], "clear")) {
+		for (i = 0; i < WATCH_MAX_PATTERNS; i++)
+			if (w->len[i] && cxt->watch_act[i].type != WATCH_SOAK)
+				watch_del(w, i);
+		return;
+	}
+
+	if (argc == 3 && !strcmp(argv[1], "del")) {
+		i = strtoul(argv[2], NULL, 0);
+		if (i >= 0 && i < WATCH_MAX_PATTERNS &&
+		    cxt->watch_act[i].type != WATCH_SOAK)
+			watch_del(w, i);
+		return;
+	}
+
+	for (act.type = 0; act.type < WATCH_SOAK; act.type++)
+		if (argc >= 3 && !strcmp(argv[1], watch_actions[act.type]))
 			break;
-		case 0x15:     			/* ^U */
-			/* We can't do that if port 1 exists */
-			if (PORT(cxt) != 0 || vdm_contexts[1].hw)
+
+	if (act.type == WATCH_SEND) {
+		act.keys_len = cmd_unescape(act.keys, argv[2], WATCH_KEYS_LEN);
+		argc--;
+		argv++;
+	}
+
+	if (act.type == WATCH_SOAK || argc < 3) {
+		cprintf(cxt, "Usage: watch [clear|del <n>|log|reboot|break|send <keys>] <pattern>\n");
+		return;
+	}
+
+	cmd_join(str, sizeof(str), argc - 2, argv + 2);
+	len = cmd_unescape(pat, str, sizeof(pat));
+
+	i = watch_add(w, pat, len);
+	if (i < 0) {
+		cprintf(cxt, "No room for another pattern\n");
+		return;
+	}
+
+	cxt->watch_act[i] = act;
+	cprintf(cxt, "Watch #%d: %s on \"%.*s\"\n",
+		i, watch_actions[act.type], len, pat);
+}
+
+static void cmd_soak(struct vdm_context *cxt, int argc, char **argv)
+{
+	struct soak *sk = &cxt->soak;
+	char str[CMDLINE_SIZE], pat[WATCH_PATTERN_LEN];
+	int cycles, timeout, len;
+
+	if (argc == 1) {
+		soak_report(cxt);
+		return;
+	}
+
+	if (argc == 2 && !strcmp(argv[1], "stop")) {
+		if (sk->state != SOAK_IDLE)
+			soak_stop(cxt);
+		return;
+	}
+
+	cycles = argc >= 4 ? strtoul(argv[1], NULL, 0) : 0;
+	timeout = argc >= 4 ? strtoul(argv[2], NULL, 0) : 0;
+	if (cycles <= 0 || cycles > SOAK_MAX_CYCLES || timeout <= 0) {
+		cprintf(cxt, "Usage: soak [stop|<cycles> <timeout s> <pattern>]\n");
+		return;
+	}
+
+	if (sk->state != SOAK_IDLE) {
+		cprintf(cxt, "Soak already running\n");
+		return;
+	}
+
+	cmd_join(str, sizeof(str), argc - 3, argv + 3);
+	len = cmd_unescape(pat, str, sizeof(pat));
+
+	sk->watch = watch_add(&cxt->watch, pat, len);
+	if (sk->watch < 0) {
+		cprintf(cxt, "No room for another pattern\n");
+		return;
+	}
+
+	cxt->watch_act[sk->watch] = (struct watch_action) {
+		.type = WATCH_SOAK,
+	};
+
+	*sk = (struct soak) {
+		.timeout_us	= timeout * 1000000ULL,
+		.cycles		= cycles,
+		.watch		= sk->watch,
+		.state		= SOAK_SETTLE,
+		.start_us	= time_us_64(),
+		.last_rx_us	= time_us_64(),
+	};
+
+	uart_rx_record(PORT(cxt), true);
+	cprintf(cxt, "Soak: %d cycles on \"%.*s\"\n", cycles, len, pat);
+	soak_arm(cxt, sk->last_rx_us + SOAK_QUIET_US);
+}
+
+static void cmd_boot(struct vdm_context *cxt, int argc, char **argv)
+{
+	char buf[128];
+
+	boot_format(PORT(cxt), buf, sizeof(buf));
+	cprintf(cxt, "%s\n", buf);
+}
+
+static void cmd_attach(struct vdm_context *cxt, int argc, char **argv)
+{
+	if (argc == 2 && !strcmp(argv[1], "forget")) {
+		cxt->attach.valid = false;
+		return;
+	}
+
+	attach_report(cxt);
+}
+
+static void cmd_pdstats(struct vdm_context *cxt, int argc, char **argv)
+{
+	if (argc == 2 && !strcmp(argv[1], "clear")) {
+		memset(cxt->stats, 0, sizeof(cxt->stats));
+		return;
+	}
+
+	pd_stats(cxt);
+}
+
+static void cmd_restart(struct vdm_context *cxt, int argc, char **argv)
+{
+	if (argc == 2 && !strcmp(argv[1], "cold")) {
+		watchdog_enable(1, 1);
+		return;
+	}
+
+	warm_restart();
+}
+
+static void cmd_pinset(struct vdm_context *cxt, int argc, char **argv)
+{
+	struct pin_probe *p = &cxt->probe;
+
+	if (argc == 1) {
+		cprintf(cxt, "Serial on %s, %s", pinsets[cxt->serial_pin_set],
+			p->enabled ? "auto" : "manual");
+		if (p->found >= 0)
+			cprintf_cont(cxt, ", last found on %s", pinsets[p->found]);
+		cprintf_cont(cxt, "\n");
+		return;
+	}
+
+	if (argc == 2 && !strcmp(argv[1], "auto")) {
+		p->enabled = true;
+		if (cxt->serial_claimed && !p->active)
+			probe_begin(cxt);
+		return;
+	}
+
+	if (argc == 2 && !strcmp(argv[1], "usb")) {
+		serial_set_pins(cxt, 1);
+		return;
+	}
+
+	if (argc == 2 && !strcmp(argv[1], "sbu")) {
+		serial_set_pins(cxt, 2);
+		return;
+	}
+
+	cprintf(cxt, "Usage: pinset [auto|usb|sbu]\n");
+}
+
+static void cmd_vdm(struct vdm_context *cxt, int argc, char **argv)
+{
+	struct vdm_queue *q = &cxt->vdmq;
+	int i, j;
+
+	if (argc == 1) {
+		cprintf(cxt, "Actions:");
+		for (i = 0; i < ARRAY_SIZE(vdm_actions); i++)
+			cprintf_cont(cxt, " %s", vdm_actions[i].name);
+		cprintf_cont(cxt, "\n");
+
+		for (i = q->head; i != q->tail; i = (i + 1) % VDM_QUEUE_LEN)
+			cprintf(cxt, "%s %s\n", i == q->head ? "in flight" : "queued   ",
+				q->req[i].name);
+		return;
+	}
+
+	/* Check everything first, so that we queue all or nothing */
+	for (i = 1; i < argc; i++) {
+		for (j = 0; j < ARRAY_SIZE(vdm_actions); j++)
+			if (!strcmp(argv[i], vdm_actions[j].name))
 				break;
 
-			cprintf(cxt, "Upstream switching to %s\n",
-				!upstream_is_serial() ? "serial" : "USB");
-			set_upstream_ops(!upstream_is_serial());
-			cprintf(cxt, "Upstream is %s\n",
-				upstream_is_serial() ? "serial" : "USB");
-			break;
-		case 0x18:			/* ^X */
-			cxt->pending = true;
-			evt_disconnect(cxt);
-			break;
-		case '?':
-			help(cxt);
+		if (j == ARRAY_SIZE(vdm_actions)) {
+			cprintf(cxt, "Unknown action %s\n", argv[i]);
+			return;
+		}
+	}
+
+	for (i = 1; i < argc; i++)
+		for (j = 0; j < ARRAY_SIZE(vdm_actions); j++)
+			if (!strcmp(argv[i], vdm_actions[j].name) &&
+			    vdm_queue(cxt, &vdm_actions[j]))
+				cprintf(cxt, ">VDM %s\n", vdm_actions[j].name);
+}
+
+static const struct {
+	const char	*name;
+	void		(*fn)(struct vdm_context *cxt, int argc, char **argv);
+	const char	*help;
+} commands[] = {
+	{ "help",	cmd_help,	"This message" },
+	{ "pace",	cmd_pace,	"Pace DUT-bound data [off|byte <us>|line <us>|echo <ms>]" },
+	{ "baud",	cmd_baud,	"Target UART rate [<rate>]" },
+	{ "break",	cmd_break,	"Send breaks, back to back [<ms>...]" },
+	{ "boot",	cmd_boot,	"When things happened since power-on" },
+	{ "attach",	cmd_attach,	"Attach timings [forget]" },
+	{ "pdstats",	cmd_pdstats,	"PD link statistics [clear]" },
+	{ "restart",	cmd_restart,	"Restart, keeping the Mac powered [cold]" },
+	{ "pinset",	cmd_pinset,	"Serial pin set [auto|usb|sbu]" },
+	{ "vdm",	cmd_vdm,	"Send Apple VDM actions, in order [<action>...]" },
+	{ "soak",	cmd_soak,	"Reboot soak [stop|<cycles> <timeout s> <pattern>]" },
+	{ "watch",	cmd_watch,	"Act on DUT output [clear|del <n>|log|reboot|break|send <keys>] <pattern>" },
+};
+
+static void cmd_help(struct vdm_context *cxt, int argc, char **argv)
+{
+	for (int i = 0; i < ARRAY_SIZE(commands); i++)
+		cprintf(cxt, "%-8s %s\n", commands[i].name, commands[i].help);
+}
+
+static void cmdline_exec(struct vdm_context *cxt)
+{
+	char *argv[CMDLINE_MAX_ARGS], *save;
+	int argc = 0;
+
+	cxt->cmd[cxt->cmd_len] = '\0';
+
+	for (char *tok = strtok_r(cxt->cmd, " \t", &save);
+	     tok && argc < CMDLINE_MAX_ARGS;
+	     tok = strtok_r(NULL, " \t", &save))
+		argv[argc++] = tok;
+
+	if (!argc)
+		return;
+
+	for (int i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(argv[0], commands[i].name)) {
+			commands[i].fn(cxt, argc, argv);
+			return;
+		}
+	}
+
+	cprintf(cxt, "Unknown command '%s', try 'help'\n", argv[0]);
+}
+
+static void cmdline_input(struct vdm_context *cxt, char c)
+{
+	switch (c) {
+	case '\r':
+	case '\n':
+		cprintf_cont(cxt, "\n");
+		cxt->cmd_active = false;
+		cmdline_exec(cxt);
+		break;
+	case 0x03:			/* ^C */
+	case 0x1b:			/* ESC */
+		cprintf_cont(cxt, " [cancelled]\n");
+		cxt->cmd_active = false;
+		break;
+	case 0x08:			/* ^H */
+	case 0x7f:			/* DEL */
+		if (cxt->cmd_len) {
+			cxt->cmd_len--;
+			cprintf_cont(cxt, "\b \b");
+		}
+		break;
+	default:
+		if (c < ' ' || cxt->cmd_len == CMDLINE_SIZE - 1)
 			break;
+
+		cxt->cmd[cxt->cmd_len++] = c;
+		upstream_ops->tx_bytes(PORT(cxt), &c, 1);
+		break;
+	}
+}
+
+/*
+ * Consume a prefix of the pending host input, returning how much was
+ * used. Zero means that the DUT can't take any more for now, and that
+ * a timer will bring us back.
+ */
+static int serial_consume(struct vdm_context *cxt, const char *buf, int len)
+{
+	if (upstream_get_raw(PORT(cxt)))
+		return serial_tx(cxt, buf, len);
+
+	if (cxt->cmd_active) {
+		cmdline_input(cxt, buf[0]);
+		return 1;
+	}
+
+	if (cxt->vdm_escape || buf[0] == 0x1f) {
+		escape_handler(cxt, buf[0]);
+		return 1;
+	}
+
+	/* Everything up to the next escape goes out in one go */
+	return serial_tx(cxt, buf, swar_find_byte(buf, len, 0x1f));
+}
+
+/* Returns true if the quantum was exhausted before running out of input */
+static bool serial_handler(struct vdm_context *cxt)
+{
+	int budget = HOST_RX_QUANTUM;
+
+	while (budget > 0) {
+		int n;
+
+		/* Raw mode changes asked for since the last byte */
+		upstream_apply_raw(PORT(cxt));
+
+		/* The end of the break brings us back */
+		if (serial_breaking(cxt))
+			return false;
+
+		if (cxt->tx_pos == cxt->tx_len) {
+			cxt->tx_pos = 0;
+			cxt->tx_len = upstream_ops->rx_bytes(PORT(cxt),
+							     cxt->tx_buf,
+							     sizeof(cxt->tx_buf));
+			if (!cxt->tx_len)
+				return false;
 		}
 
-		cxt->vdm_escape = false;
+		n = serial_consume(cxt, cxt->tx_buf + cxt->tx_pos,
+				   cxt->tx_len - cxt->tx_pos);
+		if (!n)
+			return false;
+
+		cxt->tx_pos += n;
+		budget -= n;
 	}
 
-	return uart_active;
+	return true;
+}
+
+/* Nobody picked up the source caps, try again */
+static void source_cap_timer(struct vdm_context *cxt)
+{
+	if (cxt->state != STATE_DFP_VBUS_ON || time_us_64() < cxt->source_cap_us)
+		return;
+
+	cprintf(cxt, "Sourcecap timer expired\n");
+	send_source_cap(cxt);
+	debug_poke(cxt);
 }
 
 static void state_machine(struct vdm_context *cxt)
@@ -578,7 +2469,7 @@ static void state_machine(struct vdm_context *cxt)
 	switch (cxt->state) {
 	case STATE_DISCONNECTED:{
 		int16_t cc1 = -1, cc2 = -1;
-		fusb302_tcpm_get_cc(PORT(cxt), &cc1, &cc2);
+		TCPM(cxt)->get_cc(PORT(cxt), &cc1, &cc2);
 		dprintf(cxt, "Poll: cc1=%d  cc2=%d\n", (int)cc1, (int)cc2);
 		if (cc1 >= 2 || cc2 >= 2) {
 			evt_dfpconnect(cxt, cc1, cc2);
@@ -587,12 +2478,13 @@ static void state_machine(struct vdm_context *cxt)
 		}
 		break;
 	}
+	case STATE_VBUS_DISCHARGE:
+	case STATE_DFP_DEBOUNCE:{
+		/* Timed, see state_timer() */
+		return;
+	}
 	case STATE_DFP_VBUS_ON:{
-		if (++cxt->source_cap_timer > 37) {
-			cprintf(cxt, "Sourcecap timer expired\n");
-			send_source_cap(cxt);
-			debug_poke(cxt);
-		}
+		source_cap_timer(cxt);
 		break;
 	}
 	case STATE_DFP_CONNECTED:{
@@ -614,7 +2506,7 @@ static void state_machine(struct vdm_context *cxt)
 	}
 	if (cxt->state != STATE_DISCONNECTED) {
 		int16_t cc1 = -1, cc2 = -1;
-		fusb302_tcpm_get_cc(PORT(cxt), &cc1, &cc2);
+		TCPM(cxt)->get_cc(PORT(cxt), &cc1, &cc2);
 		if (cc1 < 2 && cc2 < 2) {
 			if (cxt->cc_debounce++ > 5) {
 				cprintf(cxt, "Disconnect: cc1=%d cc2=%d\n",
@@ -628,6 +2520,27 @@ static void state_machine(struct vdm_context *cxt)
 	}
 }
 
+/* The states that wait for something, without holding up the loop */
+static void state_timer(struct vdm_context *cxt)
+{
+	if (time_us_64() < cxt->state_us)
+		return;
+
+	switch (cxt->state) {
+	case STATE_VBUS_DISCHARGE:
+		gpio_set_dir(PIN(cxt, FUSB_VBUS), GPIO_IN);
+		STATE(cxt, DISCONNECTED);
+		/* The Mac may have come back in the meantime */
+		state_machine(cxt);
+		break;
+	case STATE_DFP_DEBOUNCE:
+		cc_debounce_timer(cxt);
+		break;
+	default:
+		break;
+	}
+}
+
 const struct hw_context *get_hw_from_port(int port)
 {
 	return vdm_contexts[port].hw;
@@ -638,22 +2551,127 @@ static void fusb_int_handler(uint gpio, uint32_t event_mask)
 	for (int i = 0; i < CONFIG_USB_PD_PORT_COUNT; i++) {
 		struct vdm_context *cxt = &vdm_contexts[i];
 
-		if (!cxt->hw)
+		if (!port_live(cxt))
 			continue;
 
 		if (gpio == PIN(cxt, FUSB_INT) &&
 		    (event_mask & GPIO_IRQ_LEVEL_LOW)) {
-			cxt->pending = true;
 			gpio_set_irq_enabled(PIN(cxt, FUSB_INT), GPIO_IRQ_LEVEL_LOW, false);
+			m1_pd_bmc_wake(i, EVT_PD_IRQ);
 		}
 	}
 }
 
+void m1_pd_bmc_wake(int port, uint32_t evt)
+{
+	uint32_t flags;
+
+	if (port < 0 || port >= CONFIG_USB_PD_PORT_COUNT)
+		return;
+
+	flags = save_and_disable_interrupts();
+	if (!vdm_contexts[port].events)
+		vdm_contexts[port].wake_us = time_us_32();
+	vdm_contexts[port].events |= evt;
+	restore_interrupts(flags);
+
+	__sev();
+}
+
+static uint32_t m1_pd_bmc_take_events(struct vdm_context *cxt)
+{
+	uint32_t flags, evt, wait;
+
+	flags = save_and_disable_interrupts();
+	evt = cxt->events;
+	cxt->events = 0;
+	wait = time_us_32() - cxt->wake_us;
+	restore_interrupts(flags);
+
+	if (evt) {
+		struct service_stats *st = &cxt->latency;
+
+		st->count++;
+		st->total_us += wait;
+		st->max_us = MAX(st->max_us, wait);
+		if (wait > SERVICE_LATENCY_BOUND_US)
+			st->over++;
+	}
+
+	return evt;
+}
+
+/* Take over a FUSB302 that kept running while we restarted */
+static bool warm_adopt(struct vdm_context *cxt)
+{
+	struct warm_port *w = &warm.port[PORT(cxt)];
+	int16_t reg = 0;
+
+	if (!warm_boot || !w->live)
+		return false;
+
+	/* Only good once, a port set up again later starts afresh */
+	w->live = false;
+
+	/* Make sure this is still the chip we left behind */
+	tcpc_read(PORT(cxt), TCPC_REG_DEVICE_ID, &reg);
+	if ((reg & 0xff) != w->version) {
+		cprintf(cxt, "FUSB302 changed across restart, starting afresh\n");
+		return false;
+	}
+
+	cxt->state		= w->state;
+	cxt->probe.found	= w->found;
+	cxt->serial_pin_set	= w->serial_pin_set;
+	cxt->version		= w->version;
+	cxt->cc_line		= w->cc_line;
+	cxt->vbus		= w->vbus;
+	cxt->serial_claimed	= w->serial_claimed;
+	cxt->attach.valid	= w->attach_valid;
+	cxt->attach.cc_line	= w->attach_cc_line;
+	fusb302_set_state(PORT(cxt), &w->chip);
+
+	/* A PHY living in the Pico has lost its setup along with it */
+	if (TCPM(cxt) != &fusb302_tcpm_drv && cxt->state >= STATE_DFP_VBUS_ON) {
+		TCPM(cxt)->set_msg_header(PORT(cxt), 1, 1);
+		TCPM(cxt)->set_polarity(PORT(cxt), cxt->cc_line);
+		TCPM(cxt)->set_rx_enable(PORT(cxt), 1);
+	}
+
+	cxt->setup = SETUP_DONE;
+	boot_mark(BOOT_PD_READY, PORT(cxt));
+	if (cxt->serial_claimed)
+		boot_mark(BOOT_SERIAL, PORT(cxt));
+
+	cprintf(cxt, "Warm restart, state %d, serial on %s\n",
+		cxt->state, cxt->serial_claimed ?
+		pinsets[cxt->serial_pin_set] : "nothing");
+
+	/* Timed states start over */
+	if (cxt->state == STATE_VBUS_DISCHARGE ||
+	    cxt->state == STATE_DFP_DEBOUNCE) {
+		gpio_set_dir(PIN(cxt, FUSB_VBUS), GPIO_IN);
+		cxt->state = STATE_DISCONNECTED;
+		m1_pd_bmc_wake(PORT(cxt), EVT_PD_IRQ);
+	}
+
+	if (cxt->state == STATE_DFP_VBUS_ON) {
+		cxt->source_cap_us = time_us_64();
+		port_timer_arm(cxt, &cxt->source_cap_alarm, cxt->source_cap_us);
+	}
+
+	gpio_set_irq_enabled_with_callback(PIN(cxt, FUSB_INT), GPIO_IRQ_LEVEL_LOW, true,
+					   fusb_int_handler);
+	m1_pd_bmc_wake(PORT(cxt), EVT_UART_RX | EVT_HOST_RX);
+
+	return true;
+}
+
+/* Kick off the bring-up of a port, see setup_timer() */
 void m1_pd_bmc_fusb_setup(unsigned int port,
 			  const struct hw_context *hw)
 {
 	struct vdm_context *cxt;
-	int16_t reg;
 
 	if (port >= CONFIG_USB_PD_PORT_COUNT)
 		return;
@@ -662,21 +2680,44 @@ void m1_pd_bmc_fusb_setup(unsigned int port,
 	*cxt = (struct vdm_context) {
 		.hw			= hw,
 		.state 			= STATE_DISCONNECTED,
-		.source_cap_timer	= 0,
+		.setup			= SETUP_PROBE,
+		.vbus			= true,	/* Unknown, assume the worst */
 		.cc_debounce		= 0,
 		.verbose		= true,
 		.vdm_escape		= false,
 		.serial_pin_set		= 2, /* SBU1/2 */
+		.probe			= {
+			.enabled	= true,
+			.found		= -1,
+		},
 	};
 
+	if (warm_adopt(cxt))
+		return;
+
+	m1_pd_bmc_wake(port, EVT_TIMER);
+}
+
+/* Returns false if there is no FUSB302 to talk to */
+static bool setup_probe(struct vdm_context *cxt)
+{
+	int16_t reg = 0;
+
 	/*
 	 * If we can't infer pull-ups on the I2C, it is likely that
 	 * nothing is connected and we'd better skip this port.
 	 */
 	if (!gpio_get(PIN(cxt, I2C_SCL)) || !gpio_get(PIN(cxt, I2C_SDA))) {
-		cprintf(cxt, "I2C pins low while idling, skipping port\n");
-		cxt->hw = NULL;
-		return;
+		if (!cxt->setup_quiet)
+			cprintf(cxt, "I2C pins low while idling, skipping port\n");
+		return false;
+	}
+
+	tcpc_read(PORT(cxt), TCPC_REG_DEVICE_ID, &reg);
+	if (!(reg & 0x80)) {
+		if (!cxt->setup_quiet)
+			cprintf(cxt, "Invalid device ID. Is the FUSB302 alive?\n");
+		return false;
 	}
 
 	gpio_put(PIN(cxt, LED_G), HIGH);
@@ -684,14 +2725,8 @@ void m1_pd_bmc_fusb_setup(unsigned int port,
 	gpio_put(PIN(cxt, SBU_SWAP), LOW);
 	/* USB2.0 pins routed to USB */
 	gpio_put(PIN(cxt, SEL_USB), LOW);
-	vbus_off(cxt);
-
-	tcpc_read(PORT(cxt), TCPC_REG_DEVICE_ID, &reg);
-	if (!(reg & 0x80)) {
-		cprintf(cxt, "Invalid device ID. Is the FUSB302 alive?\n");
-		cxt->hw = NULL;
-		return;
-	}
+	/* VBUS discharges while the FUSB302 settles, see setup_timer() */
+	gpio_put(PIN(cxt, FUSB_VBUS), LOW);
 
 	cprintf(cxt, "Device ID: %c_rev%c (0x%x)\n",
 		'A' + ((reg >> 4) & 0x7), 'A' + (reg & 3), reg);
@@ -699,33 +2734,98 @@ void m1_pd_bmc_fusb_setup(unsigned int port,
 	cxt->version = reg & 0xff;
 
 	cprintf(cxt, "Init\n");
-	fusb302_tcpm_init(PORT(cxt));
+	TCPM(cxt)->init(PORT(cxt));
 
-	fusb302_pd_reset(PORT(cxt));
-	fusb302_tcpm_set_rx_enable(PORT(cxt), 0);
-	fusb302_tcpm_set_cc(PORT(cxt), TYPEC_CC_OPEN);
-	sleep_ms(500);
+	TCPM(cxt)->pd_reset(PORT(cxt));
+	TCPM(cxt)->set_rx_enable(PORT(cxt), 0);
+	TCPM(cxt)->set_cc(PORT(cxt), TYPEC_CC_OPEN);
 
-	tcpc_read(PORT(cxt), TCPC_REG_STATUS0, &reg);
-	cprintf(cxt, "STATUS0: 0x%x\n", reg);
+	return true;
+}
 
-	gpio_set_irq_enabled_with_callback(PIN(cxt, FUSB_INT), GPIO_IRQ_LEVEL_LOW, true,
-					   fusb_int_handler);
+/*
+ * Port bring-up, without ever blocking so that all ports come up
+ * together. Ports without a FUSB302 are looked at again every so
+ * often, so that a board can be plugged in later.
+ */
+static void setup_timer(struct vdm_context *cxt)
+{
+	int16_t reg;
 
-	evt_disconnect(cxt);
-	debug_poke(cxt);
+	if (time_us_64() < cxt->setup_us) {
+		port_timer_arm(cxt, &cxt->setup_alarm, cxt->setup_us);
+		return;
+	}
+
+	switch (cxt->setup) {
+	case SETUP_PROBE:
+		if (!setup_probe(cxt)) {
+			if (!cxt->setup_quiet)
+				cprintf(cxt, "Will look again every %ds\n",
+					SETUP_REPROBE_US / 1000000);
+			cxt->setup_quiet = true;
+			cxt->setup_us = time_us_64() + SETUP_REPROBE_US;
+			port_timer_arm(cxt, &cxt->setup_alarm, cxt->setup_us);
+			return;
+		}
+
+		cxt->setup = SETUP_SETTLE;
+		cxt->setup_us = time_us_64() + SETUP_SETTLE_US;
+		port_timer_arm(cxt, &cxt->setup_alarm, cxt->setup_us);
+		return;
+	case SETUP_SETTLE:
+		gpio_set_dir(PIN(cxt, FUSB_VBUS), GPIO_IN);
+		cxt->vbus = false;
+		cprintf(cxt, "Turning VBUS OFF\n");
+
+		tcpc_read(PORT(cxt), TCPC_REG_STATUS0, &reg);
+		cprintf(cxt, "STATUS0: 0x%x\n", reg);
+
+		cxt->setup = SETUP_DONE;
+		boot_mark(BOOT_PD_READY, PORT(cxt));
+		gpio_set_irq_enabled_with_callback(PIN(cxt, FUSB_INT), GPIO_IRQ_LEVEL_LOW, true,
+						   fusb_int_handler);
+
+		evt_disconnect(cxt);
+		debug_poke(cxt);
+
+		/* Whatever came in while we weren't listening */
+		m1_pd_bmc_wake(PORT(cxt), EVT_UART_RX | EVT_HOST_RX);
+		return;
+	case SETUP_DONE:
+		return;
+	}
 }
 
-static bool m1_pd_bmc_run_one(struct vdm_context *cxt)
+static void m1_pd_bmc_run_one(struct vdm_context *cxt, uint32_t evt)
 {
-	if (cxt->pending) {
+	/* Nothing but bring-up until there is a FUSB302 to talk to */
+	if (!port_live(cxt)) {
+		if (evt & EVT_TIMER)
+			setup_timer(cxt);
+		return;
+	}
+
+	if (evt & EVT_PD_IRQ) {
 		handle_irq(cxt);
 		state_machine(cxt);
-		cxt->pending = false;
 		gpio_set_irq_enabled(PIN(cxt, FUSB_INT), GPIO_IRQ_LEVEL_LOW, true);
 	}
-		
-	return serial_handler(cxt) || cxt->pending;
+
+	if (evt & EVT_TIMER) {
+		state_timer(cxt);
+		source_cap_timer(cxt);
+		vdmq_timer(cxt);
+		probe_timer(cxt);
+		soak_timer(cxt);
+	}
+
+	/* Whatever doesn't fit in a quantum gets requeued */
+	if ((evt & EVT_UART_RX) && uart_rx_drain(PORT(cxt), UART_RX_QUANTUM))
+		m1_pd_bmc_wake(PORT(cxt), EVT_UART_RX);
+
+	if ((evt & EVT_HOST_RX) && serial_handler(cxt))
+		m1_pd_bmc_wake(PORT(cxt), EVT_HOST_RX);
 }
 
 #define for_each_cxt(___c)						\
@@ -734,21 +2834,41 @@ static bool m1_pd_bmc_run_one(struct vdm_context *cxt)
 	     ___c++)							\
 		if (___c->hw)
 
+/*
+ * Only service the sources that have something pending, and sleep
+ * otherwise. Any interrupt (USB included) wakes us up, and so does
+ * m1_pd_bmc_wake() by sending an event. Ports are visited round-robin,
+ * each getting a bounded quantum of work per visit.
+ */
 void m1_pd_bmc_run(void)
 {
+	unsigned int first = 0;
+
 	while (1) {
 		bool busy = false;
 
-		for_each_cxt(cxt) {
+		/* Runs the USB stack, which may itself raise events */
+		upstream_ops->flush();
+
+		for (int i = 0; i < CONFIG_USB_PD_PORT_COUNT; i++) {
+			struct vdm_context *cxt;
+			uint32_t evt;
+
+			cxt = &vdm_contexts[(first + i) % CONFIG_USB_PD_PORT_COUNT];
+			if (!cxt->hw)
+				continue;
+
+			evt = m1_pd_bmc_take_events(cxt);
+
+			if (!evt)
+				continue;
+
 			gpio_put(PIN(cxt, LED_G), HIGH);
-			busy |= m1_pd_bmc_run_one(cxt);
-			irq_set_enabled(cxt->hw->uart_irq, false);
+			m1_pd_bmc_run_one(cxt, evt);
+			busy = true;
 		}
 
-		upstream_ops->flush();
-
-		for_each_cxt(cxt)
-			irq_set_enabled(cxt->hw->uart_irq, true);
+		first = (first + 1) % CONFIG_USB_PD_PORT_COUNT;
 
 		if (busy)
 			continue;
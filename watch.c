@@ -0,0 +1,147 @@
+// Multi-pattern (Aho-Corasick) matcher for the DUT console
+
+#include <string.h>
+
+#include "watch.h"
+
+static uint16_t watch_child(const struct watch *w, uint16_t s, char c)
+{
+	for (uint16_t n = w->nodes[s].child; n; n = w->nodes[n].sibling)
+		if (w->nodes[n].c == c)
+			return n;
+
+	return 0;
+}
+
+/* Rebuild the trie and the failure links from scratch */
+static void watch_build(struct watch *w)
+{
+	uint16_t queue[WATCH_MAX_NODES];
+	int head = 0, tail = 0;
+
+	memset(w->nodes, 0, sizeof(w->nodes));
+	w->nr_nodes = 1;
+	w->state = 0;
+
+	for (int i = 0; i < WATCH_MAX_PATTERNS; i++) {
+		uint16_t s = 0;
+
+		for (int j = 0; j < w->len[i]; j++) {
+			uint16_t n = watch_child(w, s, w->pattern[i][j]);
+
+			if (!n) {
+				n = w->nr_nodes++;
+				w->nodes[n].c = w->pattern[i][j];
+				w->nodes[n].sibling = w->nodes[s].child;
+				w->nodes[s].child = n;
+			}
+
+			s = n;
+		}
+
+		if (s)
+			w->nodes[s].out |= 1U << i;
+	}
+
+	/* Breadth first, so that a node's fail link is final before its children */
+	for (uint16_t n = w->nodes[0].child; n; n = w->nodes[n].sibling)
+		queue[tail++] = n;
+
+	while (head < tail) {
+		uint16_t s = queue[head++];
+
+		for (uint16_t n = w->nodes[s].child; n; n = w->nodes[n].sibling) {
+			uint16_t f = w->nodes[s].fail;
+			char c = w->nodes[n].c;
+
+			while (f && !watch_child(w, f, c))
+				f = w->nodes[f].fail;
+
+			w->nodes[n].fail = watch_child(w, f, c);
+			w->nodes[n].out |= w->nodes[w->nodes[n].fail].out;
+			queue[tail++] = n;
+		}
+	}
+}
+
+/*
+ * A match callback may add or remove patterns. The walk in progress
+ * holds a node index into the trie, so rebuilding it has to wait
+ * until watch_feed() is done with it.
+ */
+static void watch_update(struct watch *w)
+{
+	if (w->feeding)
+		w->stale = true;
+	else
+		watch_build(w);
+}
+
+/* Returns the pattern's index, or -1 if there is no room for it */
+int watch_add(struct watch *w, const char *pattern, int len)
+{
+	if (len <= 0 || len > WATCH_PATTERN_LEN)
+		return -1;
+
+	for (int i = 0; i < WATCH_MAX_PATTERNS; i++) {
+		/* The trie still matches what was deleted until rebuilt */
+		if (w->len[i] || (w->gone & (1U << i)))
+			continue;
+
+		memcpy(w->pattern[i], pattern, len);
+		w->len[i] = len;
+		watch_update(w);
+		return i;
+	}
+
+	return -1;
+}
+
+void watch_del(struct watch *w, int idx)
+{
+	if (idx < 0 || idx >= WATCH_MAX_PATTERNS)
+		return;
+
+	w->len[idx] = 0;
+	if (w->feeding)
+		w->gone |= 1U << idx;
+	watch_update(w);
+}
+
+void watch_feed(struct watch *w, const char *buf, int len,
+		watch_match_fn match, void *data)
+{
+	uint16_t s = w->state;
+
+	w->feeding = true;
+
+	for (int i = 0; i < len; i++) {
+		uint8_t out;
+		uint16_t n;
+
+		while (!(n = watch_child(w, s, buf[i])) && s)
+			s = w->nodes[s].fail;
+
+		s = n;
+		out = w->nodes[s].out;
+
+		while (out) {
+			int idx = __builtin_ctz(out);
+
+			/* Not if it went away in the meantime */
+			if (!(w->gone & (1U << idx)))
+				match(data, idx);
+			out &= out - 1;
+		}
+	}
+
+	w->feeding = false;
+	w->state = s;
+
+	/* Starts afresh, with the new set of patterns */
+	if (w->stale) {
+		w->stale = false;
+		w->gone = 0;
+		watch_build(w);
+	}
+}
@@ -0,0 +1,45 @@
+// Multi-pattern (Aho-Corasick) matcher for the DUT console
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define WATCH_MAX_PATTERNS	8
+#define WATCH_PATTERN_LEN	32
+#define WATCH_MAX_NODES		(WATCH_MAX_PATTERNS * WATCH_PATTERN_LEN + 1)
+
+struct watch_node {
+	uint16_t	child;		/* First child, 0 if none */
+	uint16_t	sibling;	/* Next child of our parent */
+	uint16_t	fail;
+	uint8_t		c;
+	uint8_t		out;		/* Patterns matched when we get here */
+};
+
+struct watch {
+	char			pattern[WATCH_MAX_PATTERNS][WATCH_PATTERN_LEN];
+	uint8_t			len[WATCH_MAX_PATTERNS];	/* 0: unused */
+	uint16_t		nr_nodes;
+	uint16_t		state;
+	bool			feeding;	/* Changes wait for the end */
+	bool			stale;
+	uint8_t			gone;		/* Deleted while feeding */
+	struct watch_node	nodes[WATCH_MAX_NODES];
+};
+
+typedef void (*watch_match_fn)(void *data, int idx);
+
+int watch_add(struct watch *w, const char *pattern, int len);
+void watch_del(struct watch *w, int idx);
+
+static inline bool watch_empty(const struct watch *w)
+{
+	return w->nr_nodes <= 1;
+}
+
+void watch_feed(struct watch *w, const char *buf, int len,
+		watch_match_fn match, void *data);
+
+#endif